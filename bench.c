@@ -0,0 +1,622 @@
+//ハッシュマップのベンチマーク
+//
+//ビルド: gcc -O2 hashmap.c bench.c -o bench -lpthread -lm
+//使い方: ./bench [オプション]
+//  -n N        キー数（デフォルト: 1000000）
+//  -o N        1ワークロードあたりの操作数（デフォルト: キー数）
+//  -w LIST     ワークロード（カンマ区切り、デフォルト: insert,get,update,mixed,churn,sweep）
+//                insert: 空のマップにputする
+//                get:    getする（-rのヒット率、-dの分布）
+//                update: 既存のキーにputする
+//                mixed:  -pの割合でget、残りは既存のキーにput
+//                churn:  キー数を保ったまま、古いキーの削除と新しいキーの追加を繰り返す
+//                sweep:  reserveしたマップを10%〜100%まで埋め、各段階でヒット/ミスのgetを計測する
+//                        （getの結果には使用率と探索距離も出力する）
+//                int:    整数キーのハッシュマップ（hashmap_int.h）のinsertとget（キーは-k fixed:8の先頭8バイトと同じ値）
+//  -d DIST     キーの分布 uniform|zipf（デフォルト: uniform）
+//  -s THETA    Zipf分布のパラメータ（デフォルト: 0.99）
+//  -r RATIO    getのヒット率 0〜1（デフォルト: 1）
+//  -p PCT      mixedのgetの割合（デフォルト: 90）
+//  -k SPEC     キー長の分布 fixed:L | uniform:A-B（デフォルト: uniform:8-32）
+//              （8バイトより短いキーでは2*Nが2^(8*最小長)以下であること）
+//  -H HASH     ハッシュ関数 fnv1a|fnv1|crc32|crc32c|wyhash（デフォルト: fnv1a）
+//  -i          HASH_MAP_INCREMENTALを指定する
+//  -f FORMAT   出力形式 text|json|csv（デフォルト: text、jsonは1行1ワークロード）
+//  -T TAG      結果に付けるラベル（バージョン比較用）
+//  -S SEED     乱数の種（デフォルト: 1）
+//
+//レイテンシは操作LAT_SAMPLE回に1回だけ計測し（タイマーのオーバーヘッドを抑えるため）、
+//対数のヒストグラムに集計してパーセンタイルを求める。
+//ハードウェアカウンタはperf_event_openが使える場合だけ表示する。
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "hashmap.h"
+#include "hashmap_int.h"
+
+#define LAT_SAMPLE      16      //レイテンシを計測する間隔（2のべき乗）
+#define HIST_SUB_BITS   3       //ヒストグラムの2のべき乗あたりの分割（2^3=8）
+#define HIST_SIZE       (64 << HIST_SUB_BITS)
+
+//設定
+typedef struct {
+    long n;
+    long ops;
+    const char *workloads;
+    int zipf;
+    double theta;
+    double hit_ratio;
+    int read_pct;
+    int keylen_min, keylen_max;
+    const char *keylen_spec;
+    const char *hash_name;
+    hash_map_config_t config;
+    const char *format;
+    const char *tag;
+    uint64_t seed;
+} bench_config_t;
+
+static bench_config_t conf = {
+    .n = 1000000, .workloads = "insert,get,update,mixed,churn,sweep", .theta = 0.99, .hit_ratio = 1.0,
+    .read_pct = 90, .keylen_min = 8, .keylen_max = 32, .keylen_spec = "uniform:8-32",
+    .hash_name = "fnv1a", .format = "text", .tag = "", .seed = 1,
+};
+
+//乱数（xorshift64*）
+static uint64_t rng_state;
+static inline uint64_t rng(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+static inline double rng_double(void) {
+    return (rng() >> 11) * (1.0 / (1ULL << 53));
+}
+
+//キーの集合
+//ヒットするキーn個と、存在しないキーn個をまとめて確保する。
+typedef struct {
+    char *buf;
+    long *offset;
+    int *keylen;
+    long n;
+} keys_t;
+
+static keys_t keys;
+
+static inline const char *key_of(long i) { return keys.buf + keys.offset[i]; }
+
+static uint64_t splitmix64(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+//8バイトより短いキーの番号
+//len*8ビット内の全単射（加算、奇数の乗算、xorshift）で混ぜるので、2^(len*8)個までは重ならない。
+static uint64_t short_id(uint64_t i, int len) {
+    int bits = len * 8;
+    uint64_t mask = (1ULL << bits) - 1;
+    uint64_t x = (i + conf.seed * 0x9E3779B97F4A7C15ULL) & mask;
+    x = (x * 0xBF58476D1CE4E5B9ULL) & mask;
+    x ^= x >> (bits / 2 + 1);
+    x = (x * 0x94D049BB133111EBULL) & mask;
+    return x ^ (x >> (bits / 2 + 1));
+}
+
+//キーの先頭8バイト（短ければその長さ）は番号から作り、残りはランダムな英数字にする
+static void make_keys(long n) {
+    keys.n = 2 * n;
+    keys.offset = malloc(keys.n * sizeof(long));
+    keys.keylen = malloc(keys.n * sizeof(int));
+    assert(keys.offset && keys.keylen);
+    long total = 0;
+    for (long i=0; i<keys.n; i++) {
+        keys.keylen[i] = conf.keylen_min + rng() % (conf.keylen_max - conf.keylen_min + 1);
+        keys.offset[i] = total;
+        total += keys.keylen[i];
+    }
+    keys.buf = malloc(total);
+    assert(keys.buf);
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    for (long i=0; i<keys.n; i++) {
+        char *p = keys.buf + keys.offset[i];
+        int len = keys.keylen[i];
+        uint64_t id = len < 8 ? short_id(i, len) : splitmix64(i ^ conf.seed << 40);
+        int head = len < 8 ? len : 8;
+        memcpy(p, &id, head);
+        for (int j=head; j<len; j++) p[j] = chars[rng() % (sizeof(chars)-1)];
+    }
+}
+
+//キーの分布
+//Zipf分布はGrayらの方法（YCSBと同じ）で順位を求め、ランダムな置換でキーに対応させる。
+typedef struct {
+    long n;
+    double theta, alpha, zetan, eta;
+    long *perm;
+} zipf_t;
+
+static zipf_t zipf;
+
+static double zeta(long n, double theta) {
+    double sum = 0;
+    for (long i=1; i<=n; i++) sum += 1.0 / pow(i, theta);
+    return sum;
+}
+
+static void init_zipf(long n, double theta) {
+    zipf.n = n;
+    zipf.theta = theta;
+    zipf.zetan = zeta(n, theta);
+    zipf.alpha = 1.0 / (1.0 - theta);
+    zipf.eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta(2, theta) / zipf.zetan);
+    zipf.perm = malloc(n * sizeof(long));
+    assert(zipf.perm);
+    for (long i=0; i<n; i++) zipf.perm[i] = i;
+    for (long i=n-1; i>0; i--) {
+        long j = rng() % (i+1);
+        long t = zipf.perm[i]; zipf.perm[i] = zipf.perm[j]; zipf.perm[j] = t;
+    }
+}
+
+static inline long next_zipf(void) {
+    double u = rng_double();
+    double uz = u * zipf.zetan;
+    long rank;
+    if (uz < 1.0) rank = 0;
+    else if (uz < 1.0 + pow(0.5, zipf.theta)) rank = 1;
+    else rank = (long)(zipf.n * pow(zipf.eta * u - zipf.eta + 1, zipf.alpha));
+    if (rank >= zipf.n) rank = zipf.n - 1;
+    return zipf.perm[rank];
+}
+
+//ヒットするキーの番号（0〜n-1）
+static inline long next_key(long n) {
+    return conf.zipf ? next_zipf() : (long)(rng() % n);
+}
+
+//時刻（ナノ秒）
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//レイテンシのヒストグラム（対数、2のべき乗毎に2^HIST_SUB_BITS分割）
+typedef struct {
+    long count[HIST_SIZE];
+    long total;
+    uint64_t max;
+} hist_t;
+
+static inline int hist_bucket(uint64_t v) {
+    if (v < (1 << HIST_SUB_BITS)) return v;
+    int msb = 63 - __builtin_clzll(v);
+    int sub = (v >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
+
+//バケットの上限値
+static uint64_t hist_upper(int b) {
+    if (b < (1 << HIST_SUB_BITS)) return b;
+    int msb = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    uint64_t sub = b & ((1 << HIST_SUB_BITS) - 1);
+    return ((1ULL << HIST_SUB_BITS | sub) + 1) << (msb - HIST_SUB_BITS);
+}
+
+static inline void hist_add(hist_t *hist, uint64_t v) {
+    hist->count[hist_bucket(v)]++;
+    hist->total++;
+    if (v > hist->max) hist->max = v;
+}
+
+static uint64_t hist_percentile(hist_t *hist, double p) {
+    long target = (long)ceil(hist->total * p);
+    long sum = 0;
+    for (int b=0; b<HIST_SIZE; b++) {
+        sum += hist->count[b];
+        if (sum >= target && sum > 0) {
+            uint64_t upper = hist_upper(b);
+            return upper < hist->max ? upper : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+//ハードウェアカウンタ
+//cycles, instructions, LLCミス, dTLBミス
+#define N_COUNTER 4
+static const char *counter_name[N_COUNTER] = {"cycles", "instructions", "llc_misses", "dtlb_misses"};
+static int counter_fd[N_COUNTER] = {-1, -1, -1, -1};
+
+static void init_counters(void) {
+    static const struct { uint32_t type; uint64_t config; } events[N_COUNTER] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    };
+    for (int i=0; i<N_COUNTER; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        counter_fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+}
+
+static void start_counters(void) {
+    for (int i=0; i<N_COUNTER; i++) {
+        if (counter_fd[i] < 0) continue;
+        ioctl(counter_fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+//カウンタが使えない場合は-1にする
+static void stop_counters(long *values) {
+    for (int i=0; i<N_COUNTER; i++) {
+        values[i] = -1;
+        if (counter_fd[i] < 0) continue;
+        ioctl(counter_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter_fd[i], &values[i], sizeof(long)) != sizeof(long)) values[i] = -1;
+    }
+}
+
+//ヒープの使用量（mmapで確保した大きな領域も含む）
+static size_t heap_bytes(void) {
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+//ワークロードの結果
+typedef struct {
+    const char *name;
+    long ops;
+    double sec;
+    hist_t hist;
+    double bytes_per_entry;     //計測しない場合は負
+    long counters[N_COUNTER];
+    int max_probe;              //探索距離の最大値（計測しない場合は負）
+    double avg_probe;           //探索距離の平均値
+    double load_factor;         //使用率
+} result_t;
+
+static void begin_result(result_t *result, const char *name) {
+    memset(result, 0, sizeof(result_t));
+    result->name = name;
+    result->bytes_per_entry = -1;
+    result->max_probe = -1;
+    start_counters();
+}
+
+static void end_result(result_t *result, long ops, uint64_t t0) {
+    uint64_t t1 = now_ns();
+    stop_counters(result->counters);
+    result->ops = ops;
+    result->sec = (t1 - t0) * 1e-9;
+}
+
+//結果の出力
+static void print_result(result_t *r) {
+    double ns = r->ops ? r->sec * 1e9 / r->ops : 0;
+    double mops = r->sec > 0 ? r->ops / r->sec / 1e6 : 0;
+    double p[5] = {0.5, 0.9, 0.99, 0.999, 1.0};
+    uint64_t lat[5];
+    for (int i=0; i<5; i++) lat[i] = i<4 ? hist_percentile(&r->hist, p[i]) : r->hist.max;
+
+    if (strcmp(conf.format, "json")==0) {
+        printf("{\"tag\":\"%s\",\"workload\":\"%s\",\"n\":%ld,\"dist\":\"%s\",\"theta\":%g,\"hit_ratio\":%g,"
+               "\"keylen\":\"%s\",\"hash\":\"%s\",\"incremental\":%d,\"ops\":%ld,\"sec\":%.6f,\"ns_per_op\":%.2f,\"mops\":%.3f,"
+               "\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu",
+            conf.tag, r->name, conf.n, conf.zipf ? "zipf" : "uniform", conf.theta, conf.hit_ratio,
+            conf.keylen_spec, conf.hash_name, !!(conf.config.flags & HASH_MAP_INCREMENTAL), r->ops, r->sec, ns, mops,
+            lat[0], lat[1], lat[2], lat[3], lat[4]);
+        if (r->bytes_per_entry >= 0) printf(",\"bytes_per_entry\":%.1f", r->bytes_per_entry);
+        if (r->max_probe >= 0) {
+            printf(",\"load_factor\":%.3f,\"avg_probe\":%.3f,\"max_probe\":%d", r->load_factor, r->avg_probe, r->max_probe);
+        }
+        for (int i=0; i<N_COUNTER; i++) {
+            if (r->counters[i] >= 0) printf(",\"%s_per_op\":%.2f", counter_name[i], (double)r->counters[i] / r->ops);
+        }
+        printf(",\"hist\":[");
+        int first = 1;
+        for (int b=0; b<HIST_SIZE; b++) {
+            if (!r->hist.count[b]) continue;
+            printf("%s[%lu,%ld]", first ? "" : ",", hist_upper(b), r->hist.count[b]);
+            first = 0;
+        }
+        printf("]}\n");
+    } else if (strcmp(conf.format, "csv")==0) {
+        printf("%s,%s,%ld,%ld,%.6f,%.2f,%.3f,%lu,%lu,%lu,%lu,%lu,%.1f", conf.tag, r->name, conf.n, r->ops, r->sec, ns, mops,
+            lat[0], lat[1], lat[2], lat[3], lat[4], r->bytes_per_entry);
+        for (int i=0; i<N_COUNTER; i++) {
+            if (r->counters[i] >= 0) printf(",%.2f", (double)r->counters[i] / r->ops);
+            else printf(",");
+        }
+        if (r->max_probe >= 0) printf(",%.3f,%.3f,%d\n", r->load_factor, r->avg_probe, r->max_probe);
+        else printf(",,,\n");
+    } else {
+        printf("%-14s %10ld ops %8.1f ns/op %7.2f Mops/s  p50=%lu p90=%lu p99=%lu p99.9=%lu max=%lu ns",
+            r->name, r->ops, ns, mops, lat[0], lat[1], lat[2], lat[3], lat[4]);
+        if (r->bytes_per_entry >= 0) printf("  %.1f B/entry", r->bytes_per_entry);
+        if (r->max_probe >= 0) printf("  load=%.1f%% probe=%.2f(max %d)", r->load_factor*100, r->avg_probe, r->max_probe);
+        for (int i=0; i<N_COUNTER; i++) {
+            if (r->counters[i] >= 0) printf("  %s/op=%.1f", counter_name[i], (double)r->counters[i] / r->ops);
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+//計測のマクロ
+//LAT_SAMPLE回に1回だけ操作の前後の時刻を取る。
+#define TIMED_OP(result, i, op) do { \
+    if (((i) & (LAT_SAMPLE-1)) == 0) { \
+        uint64_t _t = now_ns(); \
+        op; \
+        hist_add(&(result)->hist, now_ns() - _t); \
+    } else { \
+        op; \
+    } \
+} while (0)
+
+//ヒットするキーn個を追加したマップ
+static hash_map_t *new_filled_map(long n) {
+    hash_map_t *hash_map = new_hash_map_config(&conf.config);
+    for (long i=0; i<n; i++) put_hash_map(hash_map, key_of(i), keys.keylen[i], (void*)(uintptr_t)i);
+    return hash_map;
+}
+
+static void bench_insert(void) {
+    result_t result;
+    size_t heap0 = heap_bytes();
+    begin_result(&result, "insert");
+    uint64_t t0 = now_ns();
+    hash_map_t *hash_map = new_hash_map_config(&conf.config);
+    for (long i=0; i<conf.n; i++) {
+        TIMED_OP(&result, i, put_hash_map(hash_map, key_of(i), keys.keylen[i], (void*)(uintptr_t)i));
+    }
+    end_result(&result, conf.n, t0);
+    result.bytes_per_entry = (double)(heap_bytes() - heap0) / conf.n;
+    print_result(&result);
+    free_hash_map(hash_map);
+}
+
+//getを計測する
+//hit_ratioの割合でヒットするキー、残りは存在しないキーを検索する。
+static void run_get(hash_map_t *hash_map, const char *name, long n, double hit_ratio) {
+    result_t result;
+    begin_result(&result, name);
+    uint64_t t0 = now_ns();
+    for (long i=0; i<conf.ops; i++) {
+        long k = next_key(n);
+        if (hit_ratio < 1.0 && rng_double() >= hit_ratio) k += conf.n;
+        TIMED_OP(&result, i, get_hash_map(hash_map, key_of(k), keys.keylen[k], NULL));
+    }
+    end_result(&result, conf.ops, t0);
+    hash_map_stats_t stats;
+    stats_hash_map(hash_map, &stats);
+    hash_map_probe_stats_t probe;
+    probe_stats_hash_map(hash_map, &probe);
+    result.load_factor = stats.load_factor;
+    result.avg_probe = probe.avg_probe;
+    result.max_probe = probe.max_probe;
+    print_result(&result);
+}
+
+static void bench_get(void) {
+    hash_map_t *hash_map = new_filled_map(conf.n);
+    run_get(hash_map, "get", conf.n, conf.hit_ratio);
+    free_hash_map(hash_map);
+}
+
+static void bench_update(void) {
+    hash_map_t *hash_map = new_filled_map(conf.n);
+    result_t result;
+    begin_result(&result, "update");
+    uint64_t t0 = now_ns();
+    for (long i=0; i<conf.ops; i++) {
+        long k = next_key(conf.n);
+        TIMED_OP(&result, i, put_hash_map(hash_map, key_of(k), keys.keylen[k], (void*)(uintptr_t)i));
+    }
+    end_result(&result, conf.ops, t0);
+    print_result(&result);
+    free_hash_map(hash_map);
+}
+
+static void bench_mixed(void) {
+    hash_map_t *hash_map = new_filled_map(conf.n);
+    result_t result;
+    begin_result(&result, "mixed");
+    uint64_t t0 = now_ns();
+    for (long i=0; i<conf.ops; i++) {
+        long k = next_key(conf.n);
+        if ((long)(rng() % 100) < conf.read_pct) {
+            TIMED_OP(&result, i, get_hash_map(hash_map, key_of(k), keys.keylen[k], NULL));
+        } else {
+            TIMED_OP(&result, i, put_hash_map(hash_map, key_of(k), keys.keylen[k], (void*)(uintptr_t)i));
+        }
+    }
+    end_result(&result, conf.ops, t0);
+    print_result(&result);
+    free_hash_map(hash_map);
+}
+
+//キー数を保ったまま、最も古いキーを削除して新しいキーを追加する
+//キーは2n個を循環して使う。1操作は削除と追加の組。
+//B/entryはchurn後のマップ全体の大きさ（アリーナの断片化を含む）。
+static void bench_churn(void) {
+    size_t heap0 = heap_bytes();
+    hash_map_t *hash_map = new_filled_map(conf.n);
+    result_t result;
+    begin_result(&result, "churn");
+    uint64_t t0 = now_ns();
+    for (long i=0; i<conf.ops; i++) {
+        long old = i % keys.n;
+        long new = (i + conf.n) % keys.n;
+        TIMED_OP(&result, i, {
+            del_hash_map(hash_map, key_of(old), keys.keylen[old]);
+            put_hash_map(hash_map, key_of(new), keys.keylen[new], (void*)(uintptr_t)new);
+        });
+    }
+    end_result(&result, conf.ops, t0);
+    result.bytes_per_entry = (double)((long)(heap_bytes() - heap0)) / conf.n;
+    print_result(&result);
+    free_hash_map(hash_map);
+}
+
+//整数キーのハッシュマップ
+//キーはmake_keysのキーの先頭8バイトと同じ番号なので、-k fixed:8のinsert/getと比較できる。
+HASH_MAP_INIT_INT64(u64, void*)
+
+static void bench_int(void) {
+    uint64_t *ids = malloc(keys.n * sizeof(uint64_t));
+    assert(ids);
+    for (long i=0; i<keys.n; i++) ids[i] = splitmix64(i ^ conf.seed << 40);
+
+    result_t result;
+    size_t heap0 = heap_bytes();
+    begin_result(&result, "int_insert");
+    uint64_t t0 = now_ns();
+    u64_hash_map_t *map = new_u64_hash_map(0);
+    for (long i=0; i<conf.n; i++) {
+        TIMED_OP(&result, i, put_u64_hash_map(map, ids[i], (void*)(uintptr_t)i));
+    }
+    end_result(&result, conf.n, t0);
+    result.bytes_per_entry = (double)(heap_bytes() - heap0) / conf.n;
+    print_result(&result);
+
+    //インライン展開した検索が消えないように、見つかった数を残す
+    static volatile long found;
+    begin_result(&result, "int_get");
+    t0 = now_ns();
+    for (long i=0; i<conf.ops; i++) {
+        long k = next_key(conf.n);
+        if (conf.hit_ratio < 1.0 && rng_double() >= conf.hit_ratio) k += conf.n;
+        TIMED_OP(&result, i, found += get_u64_hash_map(map, ids[k], NULL));
+    }
+    end_result(&result, conf.ops, t0);
+    print_result(&result);
+    free_u64_hash_map(map);
+    free(ids);
+}
+
+//使用率の変化
+//n個分をreserveしたマップを10%ずつ埋め、各段階でヒットとミスのgetを計測する（分布はuniform）。
+static void bench_sweep(void) {
+    hash_map_t *hash_map = new_hash_map_config(&conf.config);
+    reserve_hash_map(hash_map, conf.n);
+    int zipf_saved = conf.zipf;
+    conf.zipf = 0;
+    static char names[10][2][32];
+    long filled = 0;
+    for (int step=1; step<=10; step++) {
+        long n = conf.n * step / 10;
+        for (; filled<n; filled++) put_hash_map(hash_map, key_of(filled), keys.keylen[filled], NULL);
+        snprintf(names[step-1][0], 32, "sweep_hit@%d%%", step*10);
+        snprintf(names[step-1][1], 32, "sweep_miss@%d%%", step*10);
+        run_get(hash_map, names[step-1][0], n, 1.0);
+        run_get(hash_map, names[step-1][1], n, 0.0);
+    }
+    conf.zipf = zipf_saved;
+    free_hash_map(hash_map);
+}
+
+static void usage(const char *cmd) {
+    fprintf(stderr, "usage: %s [-n keys] [-o ops] [-w workloads] [-d uniform|zipf] [-s theta] [-r hit_ratio]\n"
+                    "       [-p read_pct] [-k fixed:L|uniform:A-B] [-H hash] [-i] [-f text|json|csv] [-T tag] [-S seed]\n", cmd);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:o:w:d:s:r:p:k:H:if:T:S:")) != -1) {
+        switch (opt) {
+        case 'n': conf.n = atol(optarg); break;
+        case 'o': conf.ops = atol(optarg); break;
+        case 'w': conf.workloads = optarg; break;
+        case 'd':
+            if (strcmp(optarg, "zipf")==0) conf.zipf = 1;
+            else if (strcmp(optarg, "uniform")==0) conf.zipf = 0;
+            else usage(argv[0]);
+            break;
+        case 's': conf.theta = atof(optarg); break;
+        case 'r': conf.hit_ratio = atof(optarg); break;
+        case 'p': conf.read_pct = atoi(optarg); break;
+        case 'k':
+            conf.keylen_spec = optarg;
+            if (sscanf(optarg, "fixed:%d", &conf.keylen_min)==1) conf.keylen_max = conf.keylen_min;
+            else if (sscanf(optarg, "uniform:%d-%d", &conf.keylen_min, &conf.keylen_max)!=2) usage(argv[0]);
+            break;
+        case 'H': conf.hash_name = optarg; break;
+        case 'i': conf.config.flags |= HASH_MAP_INCREMENTAL; break;
+        case 'f': conf.format = optarg; break;
+        case 'T': conf.tag = optarg; break;
+        case 'S': conf.seed = strtoull(optarg, NULL, 0); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (conf.n <= 0 || conf.keylen_min < 1 || conf.keylen_max < conf.keylen_min || conf.theta <= 0 || conf.theta == 1) usage(argv[0]);
+    //短いキーでは番号が重ならない数しか作れない
+    if (conf.keylen_min < 8 && 2 * conf.n > 1L << conf.keylen_min * 8) {
+        fprintf(stderr, "too many keys for keylen %d: n <= %ld\n", conf.keylen_min, (1L << conf.keylen_min * 8) / 2);
+        usage(argv[0]);
+    }
+    if (conf.ops <= 0) conf.ops = conf.n;
+    if (strcmp(conf.hash_name, "fnv1a")==0) conf.config.hash_func = fnv1a_hash;
+    else if (strcmp(conf.hash_name, "fnv1")==0) conf.config.hash_func = fnv1_hash;
+    else if (strcmp(conf.hash_name, "crc32")==0) conf.config.hash_func = crc32_hash;
+    else if (strcmp(conf.hash_name, "crc32c")==0) conf.config.hash_func = crc32c_hash;
+    else if (strcmp(conf.hash_name, "wyhash")==0) conf.config.hash64_func = wy_hash;
+    else usage(argv[0]);
+
+    rng_state = splitmix64(conf.seed) | 1;
+    make_keys(conf.n);
+    if (conf.zipf) init_zipf(conf.n, conf.theta);
+    init_counters();
+
+    if (strcmp(conf.format, "csv")==0) {
+        printf("tag,workload,n,ops,sec,ns_per_op,mops,p50,p90,p99,p999,max,bytes_per_entry");
+        for (int i=0; i<N_COUNTER; i++) printf(",%s_per_op", counter_name[i]);
+        printf(",load_factor,avg_probe,max_probe\n");
+    } else if (strcmp(conf.format, "text")==0) {
+        printf("== n=%ld ops=%ld dist=%s theta=%g hit=%g keylen=%s hash=%s%s\n", conf.n, conf.ops,
+            conf.zipf ? "zipf" : "uniform", conf.theta, conf.hit_ratio, conf.keylen_spec, conf.hash_name,
+            conf.config.flags & HASH_MAP_INCREMENTAL ? " incremental" : "");
+    }
+
+    char *list = strdup(conf.workloads);
+    for (char *w=strtok(list, ","); w; w=strtok(NULL, ",")) {
+        if (strcmp(w, "insert")==0) bench_insert();
+        else if (strcmp(w, "get")==0) bench_get();
+        else if (strcmp(w, "update")==0) bench_update();
+        else if (strcmp(w, "mixed")==0) bench_mixed();
+        else if (strcmp(w, "churn")==0) bench_churn();
+        else if (strcmp(w, "sweep")==0) bench_sweep();
+        else if (strcmp(w, "int")==0) bench_int();
+        else {
+            fprintf(stderr, "unknown workload: %s\n", w);
+            usage(argv[0]);
+        }
+    }
+    free(list);
+    return 0;
+}
@@ -1,61 +1,403 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "hashmap.h"
+#if defined(__SSE2__) && !defined(HASH_MAP_NO_SIMD)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(HASH_MAP_NO_SIMD)
+#include <nmmintrin.h>
+#define CRC32C_HW               //SSE4.2のcrc32命令を実行時に選択できる
+#endif
 
-#define HASH_MAP_INIT_SIZE      16  //ハッシュテーブルの初期サイズ
+#define HASH_MAP_INIT_SIZE      16  //ハッシュテーブルの初期サイズ（2のべき乗）
 #define HASH_MAP_MAX_CAPACITY   70  //使用率をこれ以下に抑える
-#define HASH_MAP_LOW_CAPACITY   50  //リハッシュ時に使用率をこれ以上に保つ
 #define HASH_MAP_GROW_FACTOR    2   //リハッシュ時に何倍にするか
-#define TOMBSTONE ((void *)-1)      //削除済みエントリのキー値
+#define HASH_MAP_MIGRATE_BUCKETS 64 //インクリメンタルリハッシュで1操作毎に移動するバケット数
+#define HASH_MAP_PREFETCH_DIST  8   //バッチ処理で何個先のキーのバケットをプリフェッチするか
+#define HASH_MAP_BATCH_RING     32  //バッチ処理で先行して計算したハッシュ値を保持する数（2*PREFETCH_DIST以上の2のべき乗）
+#define HASH_KEY_INLINE_SIZE    16  //この長さ以下のキーはエントリ内に保存する
+#define HASH_ARENA_CHUNK_SIZE   (64*1024)   //キーアリーナのチャンクサイズ
+#define HASH_HUGE_PAGE_SIZE     (2*1024*1024)   //HASH_MAP_HUGE_PAGESのページサイズ（これより小さいバケット配列には使わない）
+#define HASH_MAP_MAX_BUCKETS    ((size_t)1 << 39)   //バケット数の上限（ホームのインデックスはハッシュ値のビット25-63から求める）
+
+#define GROUP_SIZE              16  //制御バイトを一度に検索する数
+
+//64ビットのハッシュ値の使い方
+//ビット32-63: エントリに保持する
+//ビット25-31: 制御バイトのタグ
+//ビット25-63をハッシュマップ毎のソルトと混ぜ、上位ビットをバケットのインデックスにする
+#define HASH_HIGH(hash) ((uint32_t)((hash) >> 32))
+#define HASH_TAG(hash)  ((uint8_t)(((hash) >> 25) & 0x7F))
+#define HASH_MUL64      0x9E3779B97F4A7C15ULL   //32ビットのハッシュ値を64ビットに広げる乗数（2^64/黄金比）
+#define HASH_INDEX_BITS (~0ULL << 25)           //インデックスに使うビット（エントリに残るビット25-63）
+#define HASH_INDEX_MIX  0xBF58476D1CE4E5B9ULL   //ソルトと混ぜたハッシュ値に掛ける奇数
+
+//制御バイト（バケット毎に1バイト）
+//0x00-0x7F: 使用中（ハッシュ値のタグ）
+#define CTRL_EMPTY      0x80        //未使用
+#define IS_FULL(c)      ((c) < 0x80)
 
 //ハッシュエントリ
 typedef struct {
-    char *key;              //ハッシュキー（バイト列）
+    union {
+        char *ptr;                          //keylen>HASH_KEY_INLINE_SIZE: アリーナ内のキー
+        char buf[HASH_KEY_INLINE_SIZE];     //keylen<=HASH_KEY_INLINE_SIZE: キー本体
+    } key;                  //ハッシュキー（バイト列）
     int keylen;             //ハッシュキーの長さ
+    uint32_t hash;          //ハッシュ値の上位32ビット（リハッシュ時にキーを読まずに済むように保持する）
     void *data;             //ハッシュデータ（任意のポインタ）
 } hash_entry_t;
 
+//キーアリーナのチャンク
+typedef struct arena_chunk {
+    struct arena_chunk *next;   //次のチャンク
+    size_t size;                //bufの確保サイズ
+    size_t used;                //bufの使用サイズ
+    char buf[];
+} arena_chunk_t;
+
+//キーアリーナ（長いキーをまとめて保存する）
+typedef struct {
+    arena_chunk_t *head;    //割り当て中のチャンク
+    size_t live;            //有効なキーのバイト数
+    size_t dead;            //削除済みキーのバイト数（コンパクション時に回収する）
+    const hash_map_allocator_t *allocator;  //チャンクを確保するアロケータ（NULLの場合はmalloc）
+} key_arena_t;
+
+//削除済みキーが有効なキーより多くなったらアリーナをコンパクションする
+#define NEED_COMPACT(arena) ((arena).dead > (arena).live && (arena).dead > HASH_ARENA_CHUNK_SIZE)
+
+//バケット配列
+typedef struct {
+    size_t capacity;        //配列の確保サイズ（GROUP_SIZE以上HASH_MAP_MAX_BUCKETS以下の2のべき乗）
+    size_t mask;            //capacity-1
+    int shift;              //hash>>shiftがホームのインデックス（64-log2(capacity)）
+    uint64_t seed;          //ホームのインデックスを求めるときのソルト（ハッシュマップのseed）
+    uint8_t *ctrl;          //制御バイト（capacity+GROUP_SIZE-1、末尾は先頭のミラー）
+    hash_entry_t *buckets;  //配列
+    uintptr_t key_base;     //長いキーのポインタに加える値（スナップショットではオフセットを保持するため）
+    uintptr_t data_base;    //データに加える値（シリアライズしたデータのスナップショットのみ）
+    uint8_t *ref;           //CLOCKの参照ビット（バケット毎に1バイト、HASH_MAP_CACHEの場合のみ）
+    size_t alloc_size;      //bucketsの確保サイズ
+    int huge;               //bucketsをヒュージページでmmapした場合は1
+} hash_table_t;
+
 //ハッシュマップ本体
 typedef struct hash_map {
-    int num;                //データ数
-    int used;               //配列の使用数（データ数+TOMBSTONE数）
-    int limit;              //配列の使用数の上限（used>limitになるとrehashする）
-    int capacity;           //配列の確保サイズ
-    hash_entry_t *buckets;  //配列
+    size_t num;             //データ数
+    size_t limit;           //データ数の上限（num>limitになるとrehashする）
+    hash_table_t table;     //バケット配列
+    hash_table_t old;       //リハッシュ中の旧バケット配列（リハッシュ中でなければbuckets==NULL）
+    size_t migrate_pos;     //旧バケット配列で次に移動するインデックス
+    size_t migrate_left;    //旧バケット配列の未処理のバケット数
+    int flags;              //HASH_MAP_INCREMENTAL, HASH_MAP_CACHE
     hash_func_t hash_func;  //ハッシュ関数
+    hash64_func_t hash64_func;  //64ビットのハッシュ関数（指定された場合はhash_funcより優先）
+    uint64_t seed;          //ソルト（イテレートした順に別のハッシュマップに挿入しても偏らないように、マップ毎に変える）
+    key_arena_t arena;      //長いキーのアリーナ
+    key_arena_t old_arena;  //コンパクション中の旧アリーナ（旧バケット配列のエントリの長いキーを保持する、head==NULLなら未使用）
+    long n_alloc;           //メモリ確保の回数
+    void *mapping;          //load_hash_mapでマップしたファイル（読み込み専用）
+    size_t mapping_size;    //マップしたサイズ
+    long rehash_count;      //リハッシュの回数
+    uint64_t rehash_ns;     //リハッシュにかかった時間の累計（ナノ秒）
+    long hits, misses, inserts, overwrites, deletes;    //操作の回数（HASH_MAP_OP_STATSの場合のみ）
+    size_t max_num;         //HASH_MAP_CACHEのデータ数の上限
+    size_t clock_hand;      //CLOCKの針（次に調べるバケット）
+    long n_evict;           //追い出した回数
+    hash_map_evict_t evict_func;    //追い出したデータを通知する関数
+    void *evict_arg;        //evict_funcの引数
+    hash_map_allocator_t allocator; //メモリ確保の関数（allocがNULLの場合はmalloc/free）
 } hash_map_t;
 
-static void make_crc_table(void);
-static void rehash(hash_map_t *hash_map);
-static void set_entry(hash_entry_t *entry, const char *keykey, int len, void *data);
+//操作の回数を数える
+#ifdef HASH_MAP_OP_STATS
+#define OP_STAT(hash_map, field, n) ((hash_map)->field += (n))
+#else
+#define OP_STAT(hash_map, field, n) ((void)0)
+#endif
+
+static void make_crc_table(uint32_t table[8][256], uint32_t poly);
+static void init_hash_map(hash_map_t *hash_map, const hash_map_config_t *config);
+static uint64_t new_seed(hash_map_t *hash_map);
+static void release_hash_map(hash_map_t *hash_map);
+static void alloc_buckets(hash_map_t *hash_map, hash_table_t *table, size_t capacity);
+static void free_buckets(hash_map_t *hash_map, hash_table_t *table);
+static void rehash(hash_map_t *hash_map, size_t capacity);
+static size_t capacity_for(size_t n);
+static void finish_rehash(hash_map_t *hash_map);
+static void set_entry(key_arena_t *arena, long *n_alloc, hash_entry_t *entry, const char *key, int keylen, uint64_t hash, void *data);
+static char *arena_alloc(key_arena_t *arena, int len, long *n_alloc);
+static void free_arena(key_arena_t *arena);
+static void compact_arena(hash_map_t *hash_map);
 void fprint_key(FILE *fp, const unsigned char *key, int keylen);
 
 //ハッシュマップを作成する。
 hash_map_t *new_hash_map(size_t init_size, hash_func_t hash_func) {
-    hash_map_t *hash_map = calloc(1, sizeof(hash_map_t));
-    assert(hash_map);
-    hash_map->capacity = init_size?init_size:HASH_MAP_INIT_SIZE;
-    hash_map->limit = (hash_map->capacity * HASH_MAP_MAX_CAPACITY) / 100;
-    hash_map->buckets = calloc(HASH_MAP_INIT_SIZE, sizeof(hash_entry_t));
-    hash_map->hash_func = hash_func?hash_func:fnv1a_hash;
-    assert(hash_map->buckets);
+    hash_map_config_t config = {.init_size = init_size, .hash_func = hash_func};
+    return new_hash_map_config(&config);
+}
+
+//メモリ確保
+//アロケータが指定されていなければmalloc/freeを使う。
+static void *mem_alloc(const hash_map_allocator_t *allocator, size_t size) {
+    void *p = (allocator && allocator->alloc) ? allocator->alloc(size, allocator->arg) : malloc(size);
+    assert(p);
+    return p;
+}
+static void mem_free(const hash_map_allocator_t *allocator, void *p, size_t size) {
+    if (p==NULL) return;
+    if (allocator && allocator->alloc) allocator->free(p, size, allocator->arg);
+    else free(p);
+}
+
+//設定を指定してハッシュマップを作成する。
+hash_map_t *new_hash_map_config(const hash_map_config_t *config) {
+    assert(config);
+    hash_map_t *hash_map = mem_alloc(&config->allocator, sizeof(hash_map_t));
+    init_hash_map(hash_map, config);
+    hash_map->n_alloc++;
     return hash_map;
 }
 
+//ハッシュマップ本体を初期化する
+static void init_hash_map(hash_map_t *hash_map, const hash_map_config_t *config) {
+    memset(hash_map, 0, sizeof(hash_map_t));
+    size_t capacity = HASH_MAP_INIT_SIZE;
+    while (capacity < config->init_size) capacity *= 2;
+    hash_map->limit = capacity * HASH_MAP_MAX_CAPACITY / 100;
+    hash_map->hash_func = config->hash_func?config->hash_func:fnv1a_hash;
+    hash_map->hash64_func = config->hash64_func;
+    hash_map->seed = new_seed(hash_map);
+    hash_map->flags = config->flags;
+    assert(!config->allocator.alloc || config->allocator.free);
+    hash_map->allocator = config->allocator;
+    hash_map->arena.allocator = &hash_map->allocator;
+    hash_map->old_arena.allocator = &hash_map->allocator;
+    if (config->flags & HASH_MAP_CACHE) {
+        //上限のデータ数を保持できるサイズで確保し、以後はリハッシュしない
+        assert(config->max_num > 0);
+        hash_map->max_num = config->max_num;
+        hash_map->evict_func = config->evict_func;
+        hash_map->evict_arg = config->evict_arg;
+        capacity = capacity_for(config->max_num);
+        hash_map->limit = SIZE_MAX;
+    }
+    alloc_buckets(hash_map, &hash_map->table, capacity);
+}
+
+//ハッシュマップ毎のソルト
+//本体のアドレスと作成した順番を混ぜて作る。
+static uint64_t new_seed(hash_map_t *hash_map) {
+    static _Atomic uint64_t counter;
+    uint64_t x = (uintptr_t)hash_map ^ atomic_fetch_add(&counter, 1) * HASH_MUL64;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
 //ハッシュマップをフリーする。
+//キーはアリーナごとまとめて解放する。
 void free_hash_map(hash_map_t *hash_map) {
-    if (hash_map) {
-        for (int i=0; i<hash_map->capacity; i++) {
-            hash_entry_t *entry = &hash_map->buckets[i];
-            if (entry->key && entry->key!=TOMBSTONE) free(entry->key);
+    if (hash_map==NULL) return;
+    hash_map_allocator_t allocator = hash_map->allocator;
+    release_hash_map(hash_map);
+    mem_free(&allocator, hash_map, sizeof(hash_map_t));
+}
+
+//ハッシュマップ本体が保持するメモリを解放する
+static void release_hash_map(hash_map_t *hash_map) {
+    free_arena(&hash_map->arena);
+    free_arena(&hash_map->old_arena);
+    if (hash_map->mapping) {
+        munmap(hash_map->mapping, hash_map->mapping_size);
+    } else {
+        free_buckets(hash_map, &hash_map->table);
+    }
+    free_buckets(hash_map, &hash_map->old);
+}
+
+//ヒュージページのメモリを確保する（sizeはHASH_HUGE_PAGE_SIZEの倍数）
+//予約済みのヒュージページ（MAP_HUGETLB）を優先し、なければ2MBにアラインした領域をmmapして
+//Transparent Huge Pagesを使うようにmadviseする。どちらも失敗した場合はNULLを返す。
+static void *huge_alloc(size_t size) {
+#ifdef MAP_HUGETLB
+    void *p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) return p;
+#endif
+    //前後を切り落としてアラインする
+    size_t map_size = size + HASH_HUGE_PAGE_SIZE;
+    char *base = mmap(NULL, map_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return NULL;
+    char *aligned = (char*)(((uintptr_t)base + HASH_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HASH_HUGE_PAGE_SIZE - 1));
+    if (aligned > base) munmap(base, aligned - base);
+    if (base + map_size > aligned + size) munmap(aligned + size, base + map_size - (aligned + size));
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+    return aligned;
+}
+
+//バケット配列と制御バイト（HASH_MAP_CACHEの場合は参照ビットも）をまとめて確保する
+//capacityは2のべき乗。
+//制御バイトはすべてCTRL_EMPTYにする。エントリは初期化しない。
+static void alloc_buckets(hash_map_t *hash_map, hash_table_t *table, size_t capacity) {
+    assert(capacity <= HASH_MAP_MAX_BUCKETS);
+    size_t size = capacity * sizeof(hash_entry_t);
+    size_t ref_size = (hash_map->flags & HASH_MAP_CACHE) ? capacity : 0;
+    table->capacity = capacity;
+    table->mask = capacity - 1;
+    table->shift = 64 - __builtin_ctzll(capacity);
+    table->seed = hash_map->seed;
+    table->alloc_size = size + capacity + GROUP_SIZE - 1 + ref_size;
+    table->buckets = NULL;
+    table->huge = 0;
+    if ((hash_map->flags & HASH_MAP_HUGE_PAGES) && table->alloc_size >= HASH_HUGE_PAGE_SIZE) {
+        table->alloc_size = (table->alloc_size + HASH_HUGE_PAGE_SIZE - 1) & ~(size_t)(HASH_HUGE_PAGE_SIZE - 1);
+        table->buckets = huge_alloc(table->alloc_size);
+        table->huge = table->buckets != NULL;
+    }
+    if (!table->buckets) table->buckets = mem_alloc(&hash_map->allocator, table->alloc_size);
+    hash_map->n_alloc++;
+    table->ctrl = (uint8_t*)table->buckets + size;
+    memset(table->ctrl, CTRL_EMPTY, capacity + GROUP_SIZE - 1);
+    table->ref = NULL;
+    if (ref_size) {
+        table->ref = table->ctrl + capacity + GROUP_SIZE - 1;
+        memset(table->ref, 0, ref_size);
+    }
+}
+
+//バケット配列を解放する
+static void free_buckets(hash_map_t *hash_map, hash_table_t *table) {
+    if (table->huge) munmap(table->buckets, table->alloc_size);
+    else mem_free(&hash_map->allocator, table->buckets, table->alloc_size);
+}
+
+//制御バイトを設定する
+//先頭GROUP_SIZE-1個は末尾のミラーにも書き込む（グループ検索が折り返さないように）。
+static inline void set_ctrl(hash_table_t *table, size_t idx, uint8_t c) {
+    table->ctrl[idx] = c;
+    if (idx < GROUP_SIZE-1) table->ctrl[table->capacity + idx] = c;
+}
+
+//制御バイトのグループ検索
+//posから始まるGROUP_SIZE個の制御バイトを調べ、条件に合うもののビットマスクを返す。
+#if defined(__SSE2__) && !defined(HASH_MAP_NO_SIMD)
+typedef __m128i group_t;
+static inline group_t group_load(const uint8_t *ctrl) {
+    return _mm_loadu_si128((const __m128i*)ctrl);
+}
+//制御バイトがcに一致
+static inline uint32_t group_match(group_t group, uint8_t c) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(c)));
+}
+//未使用
+static inline uint32_t group_match_empty(group_t group) {
+    return _mm_movemask_epi8(group);
+}
+#else
+typedef struct { uint8_t c[GROUP_SIZE]; } group_t;
+static inline group_t group_load(const uint8_t *ctrl) {
+    group_t group;
+    memcpy(group.c, ctrl, GROUP_SIZE);
+    return group;
+}
+//制御バイトがcに一致
+static inline uint32_t group_match(group_t group, uint8_t c) {
+    uint32_t mask = 0;
+    for (int i=0; i<GROUP_SIZE; i++) {
+        if (group.c[i]==c) mask |= 1u<<i;
+    }
+    return mask;
+}
+//未使用
+static inline uint32_t group_match_empty(group_t group) {
+    uint32_t mask = 0;
+    for (int i=0; i<GROUP_SIZE; i++) {
+        if (!IS_FULL(group.c[i])) mask |= 1u<<i;
+    }
+    return mask;
+}
+#endif
+
+//グループ内のビット位置からバケットのインデックスを求める
+static inline size_t group_index(hash_table_t *table, size_t pos, uint32_t mask) {
+    return (pos + __builtin_ctz(mask)) & table->mask;
+}
+
+//エントリのキーを取得する
+static inline char *entry_key(hash_table_t *table, hash_entry_t *entry) {
+    return entry->keylen<=HASH_KEY_INLINE_SIZE ? entry->key.buf : (char*)((uintptr_t)entry->key.ptr + table->key_base);
+}
+
+//エントリのデータを取得する
+static inline void *entry_data(hash_table_t *table, hash_entry_t *entry) {
+    return (void*)((uintptr_t)entry->data + table->data_base);
+}
+
+//アリーナからlenバイト確保する
+//チャンクに空きがなければ新しいチャンクを先頭に追加し、*n_allocを数える。
+static char *arena_alloc(key_arena_t *arena, int len, long *n_alloc) {
+    arena_chunk_t *chunk = arena->head;
+    if (chunk==NULL || chunk->size - chunk->used < (size_t)len) {
+        size_t size = len>HASH_ARENA_CHUNK_SIZE ? len : HASH_ARENA_CHUNK_SIZE;
+        chunk = mem_alloc(arena->allocator, sizeof(arena_chunk_t) + size);
+        (*n_alloc)++;
+        chunk->size = size;
+        chunk->used = 0;
+        chunk->next = arena->head;
+        arena->head = chunk;
+    }
+    char *p = chunk->buf + chunk->used;
+    chunk->used += len;
+    arena->live += len;
+    return p;
+}
+
+//アリーナのチャンクをすべて解放する
+static void free_arena(key_arena_t *arena) {
+    arena_chunk_t *chunk = arena->head;
+    while (chunk) {
+        arena_chunk_t *next = chunk->next;
+        mem_free(arena->allocator, chunk, sizeof(arena_chunk_t) + chunk->size);
+        chunk = next;
+    }
+    const hash_map_allocator_t *allocator = arena->allocator;
+    memset(arena, 0, sizeof(key_arena_t));
+    arena->allocator = allocator;
+}
+
+//アリーナのコンパクション
+//有効な長いキーを新しいアリーナに詰めてコピーし、古いチャンクを解放する。
+static void compact_arena(hash_map_t *hash_map) {
+    key_arena_t arena = {.allocator = &hash_map->allocator};
+    hash_table_t *tables[] = {&hash_map->table, &hash_map->old};
+    for (int t=0; t<2; t++) {
+        hash_table_t *table = tables[t];
+        for (size_t i=0; i<table->capacity; i++) {
+            hash_entry_t *entry = &table->buckets[i];
+            if (IS_FULL(table->ctrl[i]) && entry->keylen>HASH_KEY_INLINE_SIZE) {
+                char *p = arena_alloc(&arena, entry->keylen, &hash_map->n_alloc);
+                memcpy(p, entry->key.ptr, entry->keylen);
+                entry->key.ptr = p;
+            }
         }
-        free(hash_map->buckets);
     }
-    free(hash_map);
+    free_arena(&hash_map->arena);
+    hash_map->arena = arena;
 }
 
 //FNV-1A(default), FNV-1
@@ -80,102 +422,509 @@ uint32_t fnv1_hash(const char *s, int len) {
     return hash;
 }
 
-//CRC32
+//CRC32, CRC32C
 //https://ja.wikipedia.org/wiki/%E5%B7%A1%E5%9B%9E%E5%86%97%E9%95%B7%E6%A4%9C%E6%9F%BB#CRC-32
-static uint32_t crc_table[256];
-static int crc_table_computed = 0;
-static void make_crc_table(void) {
+//テーブルは最初の呼び出し時に一度だけ（pthread_onceで）作成する。
+//CRC32CはSSE4.2が使えればcrc32命令、使えなければslicing-by-8で計算する（CPUIDで一度だけ判定）。
+#define CRC32_POLY      0xEDB88320  //CRC32（反転表現）
+#define CRC32C_POLY     0x82F63B78  //CRC32C（Castagnoli、反転表現）
+static uint32_t crc32_table[8][256];
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static uint32_t crc32c_sw(const char *s, int len);
+static uint32_t (*crc32c_func)(const char *s, int len) = crc32c_sw;
+
+//slicing-by-8用のテーブルを作成する
+static void make_crc_table(uint32_t table[8][256], uint32_t poly) {
     for (uint32_t i = 0; i < 256; i++) {
         uint32_t c = i;
         for (int j = 0; j < 8; j++) {
-            c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+            c = (c & 1) ? (poly ^ (c >> 1)) : (c >> 1);
+        }
+        table[0][i] = c;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (int i = 0; i < 256; i++) {
+            uint32_t c = table[k-1][i];
+            table[k][i] = (c >> 8) ^ table[0][c & 0xFF];
         }
-        crc_table[i] = c;
     }
-    crc_table_computed = 1;
 }
-uint32_t crc32_hash(const char *s, int len) {
-    if (!crc_table_computed) make_crc_table();
 
+//slicing-by-8（8バイトずつテーブルを引く）
+static uint32_t crc_slice8(const uint32_t table[8][256], const char *s, int len) {
+    const uint8_t *p = (const uint8_t*)s;
     uint32_t c = 0xFFFFFFFF;
-    for (int i=0; i<len; i++) {
-        c = crc_table[(c ^ s[i]) & 0xFF] ^ (c >> 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; len >= 8; len -= 8, p += 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p+4, 4);
+        lo ^= c;
+        c = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^
+            table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+            table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^
+            table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+    }
+#endif
+    for (; len > 0; len--) {
+        c = table[0][(c ^ *p++) & 0xFF] ^ (c >> 8);
     }
     return c ^ 0xFFFFFFFF;
 }
 
-//リハッシュ
-static void rehash(hash_map_t *hash_map) {
-    hash_map_t new_map = {};
-    //dump_hash_map(__func__, hash_map, 0);
+static uint32_t crc32c_sw(const char *s, int len) {
+    return crc_slice8((const uint32_t (*)[256])crc32c_table, s, len);
+}
+
+#ifdef CRC32C_HW
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(const char *s, int len) {
+    uint64_t c = 0xFFFFFFFF;
+    for (; len >= 8; len -= 8, s += 8) {
+        uint64_t v;
+        memcpy(&v, s, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    uint32_t c32 = (uint32_t)c;
+    for (; len > 0; len--) {
+        c32 = _mm_crc32_u8(c32, *s++);
+    }
+    return c32 ^ 0xFFFFFFFF;
+}
+#endif
+
+//CRCのテーブル作成とCRC32Cの実装の選択
+static void crc_init(void) {
+    make_crc_table(crc32_table, CRC32_POLY);
+    make_crc_table(crc32c_table, CRC32C_POLY);
+#ifdef CRC32C_HW
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) crc32c_func = crc32c_hw;
+#endif
+}
+
+uint32_t crc32_hash(const char *s, int len) {
+    pthread_once(&crc_once, crc_init);
+    return crc_slice8((const uint32_t (*)[256])crc32_table, s, len);
+}
+
+uint32_t crc32c_hash(const char *s, int len) {
+    pthread_once(&crc_once, crc_init);
+    return crc32c_func(s, len);
+}
+
+//wyhash（64ビット、8バイトずつ処理する）
+//https://github.com/wangyi-fudan/wyhash
+#define WYP0    0xa0761d6478bd642fULL
+#define WYP1    0xe7037ed1a0b428dbULL
+#define WYP2    0x8ebc6af09c88c6e3ULL
+#define WYP3    0x589965cc75374cc3ULL
+//64x64=128ビットの乗算。*aに下位、*bに上位を返す。
+static inline void wy_mum(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a>>32, hb = *b>>32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha*hb, rm0 = ha*lb, rm1 = hb*la, rl = la*lb;
+    uint64_t t = rl + (rm0<<32), c = t < rl;
+    uint64_t lo = t + (rm1<<32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0>>32) + (rm1>>32) + c;
+#endif
+}
+static inline uint64_t wy_mix(uint64_t a, uint64_t b) {
+    wy_mum(&a, &b);
+    return a ^ b;
+}
+static inline uint64_t wy_r8(const uint8_t *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static inline uint64_t wy_r4(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+static inline uint64_t wy_r3(const uint8_t *p, size_t k) { return ((uint64_t)p[0])<<16 | ((uint64_t)p[k>>1])<<8 | p[k-1]; }
+uint64_t wy_hash(const char *s, int len) {
+    const uint8_t *p = (const uint8_t*)s;
+    size_t i = len;
+    uint64_t seed = wy_mix(WYP0, WYP1);
+    uint64_t a, b;
+    if (i <= 16) {
+        if (i >= 4) {
+            a = (wy_r4(p) << 32) | wy_r4(p + ((i>>3)<<2));
+            b = (wy_r4(p + i - 4) << 32) | wy_r4(p + i - 4 - ((i>>3)<<2));
+        } else if (i > 0) {
+            a = wy_r3(p, i);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wy_mix(wy_r8(p) ^ WYP1, wy_r8(p+8) ^ seed);
+                see1 = wy_mix(wy_r8(p+16) ^ WYP2, wy_r8(p+24) ^ see1);
+                see2 = wy_mix(wy_r8(p+32) ^ WYP3, wy_r8(p+40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wy_mix(wy_r8(p) ^ WYP1, wy_r8(p+8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = wy_r8(p + i - 16);
+        b = wy_r8(p + i - 8);
+    }
+    a ^= WYP1;
+    b ^= seed;
+    wy_mum(&a, &b);
+    return wy_mix(a ^ WYP0 ^ (uint64_t)len, b ^ WYP1);
+}
+
+//キーの64ビットのハッシュ値
+//32ビットのハッシュ関数の場合は乗算で上位ビットに広げる。
+static inline uint64_t hash_key(hash_map_t *hash_map, const char *key, int keylen) {
+    if (hash_map->hash64_func) return hash_map->hash64_func(key, keylen);
+    return hash_map->hash_func(key, keylen) * HASH_MUL64;
+}
+
+//ハッシュ値のホームのインデックス
+//ハッシュ値のビット25-63（エントリのhashとタグ）をソルトと混ぜて乗算し、上位ビットを使う。
+//ソルトはハッシュマップ毎に異なるので、あるマップのバケット順（イテレートした順）は別のマップではランダムな順になる。
+static inline size_t home_index(hash_table_t *table, uint64_t hash) {
+    return ((hash & HASH_INDEX_BITS) ^ table->seed) * HASH_INDEX_MIX >> table->shift;
+}
+
+//エントリのhashとタグからホームのインデックスを求めるためのハッシュ値（ビット0-24は0）
+static inline uint64_t entry_hash(uint32_t high, uint8_t tag) {
+    return (uint64_t)high << 32 | (uint64_t)tag << 25;
+}
+
+//バケットidxのエントリのホーム位置からの距離
+static inline int probe_dist(hash_table_t *table, size_t idx) {
+    return (idx - home_index(table, entry_hash(table->buckets[idx].hash, table->ctrl[idx]))) & table->mask;
+}
+
+//キーのエントリを探す
+//見つかればインデックス、見つからなければ-1を返す。
+//タグが一致したエントリだけキーを比較する。
+//TOMBSTONEがないので、探索列は最初の未使用バケットで終わる。
+static long find_entry(hash_table_t *table, const char *key, int keylen, uint64_t hash) {
+    uint8_t tag = HASH_TAG(hash);
+    uint32_t high = HASH_HIGH(hash);
+    size_t pos = home_index(table, hash);
+    for (;;) {
+        group_t group = group_load(&table->ctrl[pos]);
+        uint32_t match = group_match(group, tag);
+        uint32_t empty = group_match_empty(group);
+        if (empty) match &= (empty & -empty) - 1;   //最初の未使用以降は別の探索列
+        while (match) {
+            size_t idx = group_index(table, pos, match);
+            hash_entry_t *entry = &table->buckets[idx];
+            if (entry->hash==high && entry->keylen==keylen && memcmp(entry_key(table, entry), key, keylen)==0) return idx;
+            match &= match - 1;
+        }
+        if (empty) return -1;
+        pos = (pos + GROUP_SIZE) & table->mask;
+    }
+}
 
-    //サイズを拡張した新しいハッシュマップを作成する
-    new_map = *hash_map;
-    if (new_map.num >= (hash_map->capacity * HASH_MAP_LOW_CAPACITY) / 100) {
-        new_map.capacity = hash_map->capacity * HASH_MAP_GROW_FACTOR;
-        new_map.limit = (new_map.capacity * HASH_MAP_MAX_CAPACITY) / 100;
-    }
-    new_map.buckets = calloc(new_map.capacity, sizeof(hash_entry_t));
-    assert(new_map.buckets);
-
-    //すべてのエントリをコピーする
-    for (int i=0; i<hash_map->capacity; i++) {
-        hash_entry_t *entry = &hash_map->buckets[i];
-        if (entry->key && entry->key != TOMBSTONE) {
-            int idx = hash_map->hash_func(entry->key, entry->keylen) % new_map.capacity;
-            hash_entry_t *new_entry = &new_map.buckets[idx];
-            while (new_entry->key) {
-                if (++idx >= new_map.capacity) idx = 0;
-                new_entry = &new_map.buckets[idx];
+//キーのエントリをハッシュマップから探す
+//リハッシュ中は旧バケット配列も探し、見つかった配列を*tableに返す。
+static long find_entry_map(hash_map_t *hash_map, const char *key, int keylen, uint64_t hash, hash_table_t **table) {
+    *table = &hash_map->table;
+    long idx = find_entry(*table, key, keylen, hash);
+    if (idx < 0 && hash_map->old.buckets) {
+        *table = &hash_map->old;
+        idx = find_entry(*table, key, keylen, hash);
+    }
+    return idx;
+}
+
+//参照ビットを立てる（HASH_MAP_CACHE）
+//立っていれば書き込まないので、参照済みのエントリのヒットではキャッシュラインを汚さない。
+static inline void set_ref(hash_table_t *table, size_t idx) {
+    if (table->ref && !table->ref[idx]) table->ref[idx] = 1;
+}
+
+//エントリを挿入する（Robin Hood）
+//ホームからの距離が自分より短いエントリを追い出して入れ替わる。
+//タグはエントリに保持していないので、制御バイトごと入れ替える。
+//最初に渡したエントリが入ったインデックスを返す。
+//参照ビットがある場合はエントリと一緒に移動する（新しいエントリは参照済みにする）。
+static size_t insert_entry(hash_table_t *table, hash_entry_t entry, uint8_t tag) {
+    size_t idx = home_index(table, entry_hash(entry.hash, tag));
+    int dist = 0;
+    size_t ret = SIZE_MAX;
+    uint8_t ref = 1;
+    for (;;) {
+        if (table->ctrl[idx]==CTRL_EMPTY) {
+            set_ctrl(table, idx, tag);
+            table->buckets[idx] = entry;
+            if (table->ref) table->ref[idx] = ref;
+            return ret==SIZE_MAX ? idx : ret;
+        }
+        int d = probe_dist(table, idx);
+        if (d < dist) {
+            hash_entry_t tmp = table->buckets[idx];
+            uint8_t tmp_tag = table->ctrl[idx];
+            set_ctrl(table, idx, tag);
+            table->buckets[idx] = entry;
+            entry = tmp;
+            tag = tmp_tag;
+            if (table->ref) {
+                uint8_t tmp_ref = table->ref[idx];
+                table->ref[idx] = ref;
+                ref = tmp_ref;
             }
-            *new_entry = *entry;
+            dist = d;
+            if (ret==SIZE_MAX) ret = idx;
         }
+        idx = (idx + 1) & table->mask;
+        dist++;
     }
-    free(hash_map->buckets);
-    *hash_map = new_map;
+}
+
+//エントリを削除する（後方シフト）
+//後続のエントリをホームに近づく方向に1つずつ詰めるので、TOMBSTONEは残らない。
+static void remove_entry(hash_table_t *table, size_t idx) {
+    for (;;) {
+        size_t next = (idx + 1) & table->mask;
+        if (table->ctrl[next]==CTRL_EMPTY || probe_dist(table, next)==0) break;
+        set_ctrl(table, idx, table->ctrl[next]);
+        table->buckets[idx] = table->buckets[next];
+        if (table->ref) table->ref[idx] = table->ref[next];
+        idx = next;
+    }
+    set_ctrl(table, idx, CTRL_EMPTY);
+}
+
+//時刻（ナノ秒、リハッシュの時間の計測用）
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//旧バケット配列から新しいバケット配列にエントリを移動する
+//少なくともn個のバケットを処理し、クラスタ（連続した使用中バケット）の途中では止めない。
+//クラスタ単位で移動するので、旧バケット配列に残ったエントリの探索列は壊れない。
+//コンパクション中は長いキーを新しいアリーナにコピーし、移動が終わったら旧アリーナを解放する。
+static void migrate_buckets(hash_map_t *hash_map, size_t n) {
+    hash_table_t *old = &hash_map->old;
+    key_arena_t *old_arena = &hash_map->old_arena;
+    uint64_t t0 = now_ns();
+    while (hash_map->migrate_left > 0) {
+        size_t pos = hash_map->migrate_pos;
+        if (n == 0 && old->ctrl[pos]==CTRL_EMPTY) {
+            hash_map->rehash_ns += now_ns() - t0;
+            return;
+        }
+        if (IS_FULL(old->ctrl[pos])) {
+            hash_entry_t entry = old->buckets[pos];
+            if (old_arena->head && entry.keylen>HASH_KEY_INLINE_SIZE) {
+                char *p = arena_alloc(&hash_map->arena, entry.keylen, &hash_map->n_alloc);
+                memcpy(p, entry.key.ptr, entry.keylen);
+                entry.key.ptr = p;
+                old_arena->live -= entry.keylen;
+            }
+            insert_entry(&hash_map->table, entry, old->ctrl[pos]);
+            set_ctrl(old, pos, CTRL_EMPTY);
+        }
+        hash_map->migrate_pos = (pos + 1) & old->mask;
+        hash_map->migrate_left--;
+        if (n > 0) n--;
+    }
+    free_buckets(hash_map, old);
+    memset(old, 0, sizeof(hash_table_t));
+    free_arena(old_arena);
+    hash_map->rehash_ns += now_ns() - t0;
+}
+
+//リハッシュ中であれば残りのエントリをすべて移動する
+static void finish_rehash(hash_map_t *hash_map) {
+    if (hash_map->old.buckets) migrate_buckets(hash_map, hash_map->migrate_left);
+}
+
+//capacityの新しいバケット配列を作成し、旧バケット配列からの移動を始める
+//compactが1の場合はキーアリーナもコンパクションする（移動するエントリの長いキーを新しいアリーナにコピーする）。
+static void begin_migrate(hash_map_t *hash_map, size_t capacity, int compact) {
+    hash_map->old = hash_map->table;
+    alloc_buckets(hash_map, &hash_map->table, capacity);
+    hash_map->limit = hash_map->table.capacity * HASH_MAP_MAX_CAPACITY / 100;
+    if (compact && hash_map->arena.head) {
+        hash_map->old_arena = hash_map->arena;
+        hash_map->arena = (key_arena_t){.allocator = &hash_map->allocator};
+    }
+
+    //未使用バケットから移動を始める（そこをまたぐクラスタはない）
+    size_t pos = 0;
+    while (hash_map->old.ctrl[pos]!=CTRL_EMPTY) pos++;
+    hash_map->migrate_pos = pos;
+    hash_map->migrate_left = hash_map->old.capacity;
+}
+
+//リハッシュ
+//capacityの新しいバケット配列を作成し、旧バケット配列のエントリを移動する（縮小も可）。
+//HASH_MAP_INCREMENTALの場合はここでは移動せず、以後の操作毎に少しずつ移動する。
+//アリーナのコンパクションが必要であれば、エントリの移動と一緒に行う。
+static void rehash(hash_map_t *hash_map, size_t capacity) {
+    //dump_hash_map(__func__, hash_map, 0);
+    finish_rehash(hash_map);
+
+    //エントリの移動はmigrate_bucketsで計測する
+    uint64_t t0 = now_ns();
+    hash_map->rehash_count++;
+    begin_migrate(hash_map, capacity, NEED_COMPACT(hash_map->arena));
+    hash_map->rehash_ns += now_ns() - t0;
+
+    if (!(hash_map->flags & HASH_MAP_INCREMENTAL)) finish_rehash(hash_map);
 }
 
 //エントリーにキーとデータを設定
-static void set_entry(hash_entry_t *entry, const char *key, int keylen, void *data) {
-    if (entry->key==TOMBSTONE) entry->key = NULL;
-    entry->key = realloc(entry->key, keylen);
-    assert(entry->key);
+//短いキーはエントリ内に、長いキーはアリーナに保存する。
+static void set_entry(key_arena_t *arena, long *n_alloc, hash_entry_t *entry, const char *key, int keylen, uint64_t hash, void *data) {
+    char *p = keylen<=HASH_KEY_INLINE_SIZE ? entry->key.buf : arena_alloc(arena, keylen, n_alloc);
+    memcpy(p, key, keylen);
+    if (keylen>HASH_KEY_INLINE_SIZE) entry->key.ptr = p;
     entry->keylen = keylen;
-    memcpy(entry->key, key, keylen);
+    entry->hash = HASH_HIGH(hash);
     entry->data = data;
 }
 
+//バケットidxのエントリを削除する
+//長いキーの領域は削除済みとして数え、多くなったらアリーナをコンパクションする。
+//HASH_MAP_INCREMENTALの場合は同じサイズのバケット配列への移動を始め、移動と一緒に少しずつコンパクションする
+//（リハッシュ中であれば、終わった後の削除まで待つ）。
+static void delete_entry(hash_map_t *hash_map, hash_table_t *table, size_t idx) {
+    int keylen = table->buckets[idx].keylen;
+    if (keylen>HASH_KEY_INLINE_SIZE) {
+        key_arena_t *arena = table==&hash_map->old && hash_map->old_arena.head ? &hash_map->old_arena : &hash_map->arena;
+        arena->live -= keylen;
+        arena->dead += keylen;
+    }
+    remove_entry(table, idx);
+    hash_map->num--;
+    if (!NEED_COMPACT(hash_map->arena)) return;
+    if (!(hash_map->flags & HASH_MAP_INCREMENTAL) || (hash_map->flags & HASH_MAP_CACHE)) {
+        compact_arena(hash_map);
+    } else if (!hash_map->old.buckets) {
+        uint64_t t0 = now_ns();
+        begin_migrate(hash_map, hash_map->table.capacity, 1);
+        hash_map->rehash_ns += now_ns() - t0;
+    }
+}
+
+//CLOCKで選んだエントリを追い出す（HASH_MAP_CACHE）
+//針の位置から使用中のバケットを順に調べ、参照ビットが立っていれば落として次へ進み、
+//立っていなければそのエントリを追い出す。後方シフトで次のエントリが詰まるので針はそこに留める。
+static void evict_entry(hash_map_t *hash_map) {
+    hash_table_t *table = &hash_map->table;
+    for (;;) {
+        size_t idx = hash_map->clock_hand;
+        hash_map->clock_hand = (idx + 1) & table->mask;
+        if (!IS_FULL(table->ctrl[idx])) continue;
+        if (table->ref[idx]) {
+            table->ref[idx] = 0;
+            continue;
+        }
+        hash_entry_t *entry = &table->buckets[idx];
+        if (hash_map->evict_func) hash_map->evict_func(entry_key(table, entry), entry->keylen, entry->data, hash_map->evict_arg);
+        delete_entry(hash_map, table, idx);
+        hash_map->clock_hand = idx;
+        hash_map->n_evict++;
+        return;
+    }
+}
+
+//ハッシュ値を計算済みのキーのエントリを探し、なければデータNULLで追加する
+//追加した場合は*insertedに1、既存の場合は0を設定する。キーをコピーするのは追加した場合だけ。
+static hash_entry_t *upsert_entry(hash_map_t *hash_map, const char *key, int keylen, uint64_t hash, int *inserted) {
+    if (hash_map->num > hash_map->limit) {
+        rehash(hash_map, hash_map->table.capacity * HASH_MAP_GROW_FACTOR);
+    }
+    hash_table_t *table;
+    long idx = find_entry_map(hash_map, key, keylen, hash, &table);
+    if (idx >= 0) {
+        set_ref(table, idx);
+        *inserted = 0;
+        return &table->buckets[idx];
+    }
+    if (hash_map->num >= hash_map->max_num && (hash_map->flags & HASH_MAP_CACHE)) evict_entry(hash_map);
+    hash_entry_t entry;
+    set_entry(&hash_map->arena, &hash_map->n_alloc, &entry, key, keylen, hash, NULL);
+    hash_map->num++;
+    *inserted = 1;
+    return &hash_map->table.buckets[insert_entry(&hash_map->table, entry, HASH_TAG(hash))];
+}
+
+//ハッシュ値を計算済みのキーのデータ書き込み
+static int put_entry(hash_map_t *hash_map, const char *key, int keylen, uint64_t hash, void *data) {
+    int inserted;
+    upsert_entry(hash_map, key, keylen, hash, &inserted)->data = data;
+    return inserted;
+}
+
 //データ書き込み
 //すでにデータが存在する場合は上書きし0を返す。新規データ時は1を返す。
 //キーにNULLは指定できない。dataにNULLを指定できる。
 int put_hash_map(hash_map_t *hash_map, const char *key, int keylen, void *data) {
     assert(hash_map);
     assert(key);
-    if (hash_map->used > hash_map->limit) {
-        rehash(hash_map);
-    }
- 
-    int idx = hash_map->hash_func(key, keylen) % hash_map->capacity;
-    hash_entry_t *entry_tombstome = NULL;   //新規データを書き込みできる削除済みアイテム
-    for (;;) {
-        hash_entry_t *entry = &hash_map->buckets[idx];
-        if (entry->key==NULL) {
-            if (entry_tombstome) {
-                set_entry(entry_tombstome, key, keylen, data);
-            } else {
-                set_entry(entry, key, keylen, data);
-                hash_map->used++;
-            }
-            hash_map->num++;
-            return 1;
-        } else if (entry->key==TOMBSTONE) {
-            if (entry_tombstome==NULL) entry_tombstome = entry;
-        } else if (entry->keylen==keylen && memcmp(entry->key, key, keylen)==0) {
-            entry->data = data;
-            return 0;
-        }
-        if (++idx >= hash_map->capacity) idx = 0;
+    assert(!hash_map->mapping);
+    if (hash_map->old.buckets) migrate_buckets(hash_map, HASH_MAP_MIGRATE_BUCKETS);
+    int ret = put_entry(hash_map, key, keylen, hash_key(hash_map, key, keylen), data);
+    if (ret) OP_STAT(hash_map, inserts, 1);
+    else OP_STAT(hash_map, overwrites, 1);
+    return ret;
+}
+
+//キーのデータの格納場所を返す（なければデータNULLで追加する）
+//ハッシュ値の計算と探索は1回だけで、既存のキーはコピーしない。
+//返すポインタはハッシュマップを次に操作するまで有効。
+void **upsert_hash_map(hash_map_t *hash_map, const char *key, int keylen, int *inserted) {
+    assert(hash_map);
+    assert(key);
+    assert(!hash_map->mapping);
+    if (hash_map->old.buckets) migrate_buckets(hash_map, HASH_MAP_MIGRATE_BUCKETS);
+    int ins;
+    hash_entry_t *entry = upsert_entry(hash_map, key, keylen, hash_key(hash_map, key, keylen), &ins);
+    if (ins) OP_STAT(hash_map, inserts, 1);
+    else OP_STAT(hash_map, hits, 1);
+    if (inserted) *inserted = ins;
+    return &entry->data;
+}
+
+//キーのデータの格納場所を返す（なければNULL）
+//追加もメモリ確保もしない。返すポインタはハッシュマップを次に操作するまで有効。
+void **find_slot_hash_map(hash_map_t *hash_map, const char *key, int keylen) {
+    assert(hash_map);
+    assert(key);
+    assert(!hash_map->mapping);
+    if (hash_map->old.buckets) migrate_buckets(hash_map, HASH_MAP_MIGRATE_BUCKETS);
+    hash_table_t *table;
+    long idx = find_entry_map(hash_map, key, keylen, hash_key(hash_map, key, keylen), &table);
+    if (idx < 0) {
+        OP_STAT(hash_map, misses, 1);
+        return NULL;
     }
+    OP_STAT(hash_map, hits, 1);
+    set_ref(table, idx);
+    return &table->buckets[idx].data;
+}
+
+//ハッシュ値を計算済みのキーのデータの取得
+//リハッシュ中でもバケットは移動しない（ハッシュマップを変更しない）。
+static int get_entry(hash_map_t *hash_map, const char *key, int keylen, uint64_t hash, void **data) {
+    hash_table_t *table;
+    long idx = find_entry_map(hash_map, key, keylen, hash, &table);
+    if (idx < 0) return 0;
+    set_ref(table, idx);
+    if (data) *data = entry_data(table, &table->buckets[idx]);
+    return 1;
 }
 
 //キーに対応するデータの取得
@@ -184,17 +933,20 @@ int put_hash_map(hash_map_t *hash_map, const char *key, int keylen, void *data)
 int get_hash_map(hash_map_t *hash_map, const char *key, int keylen, void **data) {
     assert(hash_map);
     assert(key);
-    int idx = hash_map->hash_func(key, keylen) % hash_map->capacity;
+    if (hash_map->old.buckets) migrate_buckets(hash_map, HASH_MAP_MIGRATE_BUCKETS);
+    int ret = get_entry(hash_map, key, keylen, hash_key(hash_map, key, keylen), data);
+    if (ret) OP_STAT(hash_map, hits, 1);
+    else OP_STAT(hash_map, misses, 1);
+    return ret;
+}
 
-    for (;;) {
-        hash_entry_t *entry = &hash_map->buckets[idx];
-        if (entry->key==NULL) return 0;
-        if (entry->keylen==keylen && memcmp(entry->key, key, keylen)==0) {
-            if (data) *data = entry->data;
-            return 1;
-        }
-        if (++idx >= hash_map->capacity) idx = 0;
-    }
+//ハッシュ値を計算済みのキーのデータの削除
+static int del_entry(hash_map_t *hash_map, const char *key, int keylen, uint64_t hash) {
+    hash_table_t *table;
+    long idx = find_entry_map(hash_map, key, keylen, hash, &table);
+    if (idx < 0) return 0;
+    delete_entry(hash_map, table, idx);
+    return 1;
 }
 
 //データの削除
@@ -203,59 +955,720 @@ int get_hash_map(hash_map_t *hash_map, const char *key, int keylen, void **data)
 int del_hash_map(hash_map_t *hash_map, const char *key, int keylen) {
     assert(hash_map);
     assert(key);
-    int idx = hash_map->hash_func(key, keylen) % hash_map->capacity;
+    assert(!hash_map->mapping);
+    if (hash_map->old.buckets) migrate_buckets(hash_map, HASH_MAP_MIGRATE_BUCKETS);
+    int ret = del_entry(hash_map, key, keylen, hash_key(hash_map, key, keylen));
+    OP_STAT(hash_map, deletes, ret);
+    return ret;
+}
 
-    for (;;) {
-        hash_entry_t *entry = &hash_map->buckets[idx];
-        if (entry->key==NULL) return 0;
-        if (entry->keylen==keylen && memcmp(entry->key, key, keylen)==0) {
-            free(entry->key);
-            entry->key = TOMBSTONE;
-            entry->keylen = 0;
-            entry->data = NULL;
-            hash_map->num--;
-            return 1;
+//データ数nをリハッシュせずに保持できるバケット数
+static size_t capacity_for(size_t n) {
+    size_t capacity = HASH_MAP_INIT_SIZE;
+    while (capacity * HASH_MAP_MAX_CAPACITY / 100 < n) capacity *= 2;
+    return capacity;
+}
+
+//データ数nまでリハッシュしないようにバケット配列を拡張する
+//現在のサイズで足りる場合は何もしない。HASH_MAP_INCREMENTALでもすぐに移動を完了する。
+void reserve_hash_map(hash_map_t *hash_map, size_t n) {
+    assert(hash_map);
+    assert(!hash_map->mapping);
+    if (hash_map->flags & HASH_MAP_CACHE) return;
+    size_t capacity = capacity_for(n);
+    if (capacity > hash_map->table.capacity) {
+        rehash(hash_map, capacity);
+        finish_rehash(hash_map);
+    }
+}
+
+//データ数に合わせてバケット配列を縮小し、キーアリーナをコンパクションする
+//新しいバケット配列は旧配列の半分以下なので、一時的なメモリは旧配列の1.5倍まで。
+void shrink_hash_map(hash_map_t *hash_map) {
+    assert(hash_map);
+    assert(!hash_map->mapping);
+    size_t capacity = capacity_for(hash_map->num);
+    finish_rehash(hash_map);
+    if (capacity < hash_map->table.capacity && !(hash_map->flags & HASH_MAP_CACHE)) {
+        rehash(hash_map, capacity);
+        finish_rehash(hash_map);
+    }
+    compact_hash_map(hash_map);
+}
+
+//キーアリーナのコンパクション
+//削除済みキーの領域を回収する（削除でNEED_COMPACTになった場合は自動で行う）。
+//TOMBSTONEはないのでバケット配列はそのまま。
+void compact_hash_map(hash_map_t *hash_map) {
+    assert(hash_map);
+    assert(!hash_map->mapping);
+    finish_rehash(hash_map);
+    if (hash_map->arena.dead > 0) compact_arena(hash_map);
+}
+
+//ホームのバケット（制御バイトとエントリ）をプリフェッチする
+static inline void prefetch_bucket(hash_table_t *table, uint64_t hash) {
+    size_t idx = home_index(table, hash);
+    __builtin_prefetch(&table->ctrl[idx]);
+    __builtin_prefetch(&table->buckets[idx]);
+}
+
+//タグが一致する最初のエントリの長いキーをプリフェッチする
+//制御バイトとエントリはprefetch_bucketでキャッシュに載っている前提。
+static inline void prefetch_key(hash_table_t *table, uint64_t hash) {
+    size_t pos = home_index(table, hash);
+    uint32_t match = group_match(group_load(&table->ctrl[pos]), HASH_TAG(hash));
+    if (match) {
+        hash_entry_t *entry = &table->buckets[group_index(table, pos, match)];
+        if (entry->keylen>HASH_KEY_INLINE_SIZE) __builtin_prefetch(entry_key(table, entry));
+    }
+}
+
+//複数のキーのデータをまとめて取得する
+//キーのハッシュ値を先行して計算し、PREFETCH_DIST個先のキーのバケットと、その半分先のキーの
+//バケット内の長いキーをプリフェッチしてから検索するので、キャッシュミスの待ち時間が重なる。
+size_t get_hash_map_batch(hash_map_t *hash_map, const char *const *keys, const int *keylens, size_t n, void **data, int *found) {
+    assert(hash_map);
+    assert(keys && keylens);
+    if (hash_map->old.buckets) migrate_buckets(hash_map, HASH_MAP_MIGRATE_BUCKETS);
+    hash_table_t *table = &hash_map->table;
+    uint64_t hash[HASH_MAP_BATCH_RING];
+    size_t num = 0;
+    for (size_t i=0; i<n+2*HASH_MAP_PREFETCH_DIST; i++) {
+        if (i < n) {
+            hash[i%HASH_MAP_BATCH_RING] = hash_key(hash_map, keys[i], keylens[i]);
+            prefetch_bucket(table, hash[i%HASH_MAP_BATCH_RING]);
+        }
+        size_t j = i - HASH_MAP_PREFETCH_DIST;
+        if (i >= HASH_MAP_PREFETCH_DIST && j < n) prefetch_key(table, hash[j%HASH_MAP_BATCH_RING]);
+        size_t k = i - 2*HASH_MAP_PREFETCH_DIST;
+        if (i >= 2*HASH_MAP_PREFETCH_DIST) {
+            void *d = NULL;
+            int ret = get_entry(hash_map, keys[k], keylens[k], hash[k%HASH_MAP_BATCH_RING], &d);
+            if (data)  data[k]  = d;
+            if (found) found[k] = ret;
+            num += ret;
+        }
+    }
+    OP_STAT(hash_map, hits, num);
+    OP_STAT(hash_map, misses, n - num);
+    return num;
+}
+
+//複数のキーのデータをまとめて書き込む
+//keys[i]の順にput_hash_mapしたのと同じ結果になる。
+size_t put_hash_map_batch(hash_map_t *hash_map, const char *const *keys, const int *keylens, void *const *data, size_t n) {
+    assert(hash_map);
+    assert(keys && keylens);
+    assert(!hash_map->mapping);
+    if (hash_map->old.buckets) migrate_buckets(hash_map, HASH_MAP_MIGRATE_BUCKETS);
+    uint64_t hash[HASH_MAP_BATCH_RING];
+    size_t num = 0;
+    for (size_t i=0; i<n+2*HASH_MAP_PREFETCH_DIST; i++) {
+        //put_entryでリハッシュするとバケット配列が変わるので毎回参照する
+        if (i < n) {
+            hash[i%HASH_MAP_BATCH_RING] = hash_key(hash_map, keys[i], keylens[i]);
+            prefetch_bucket(&hash_map->table, hash[i%HASH_MAP_BATCH_RING]);
+        }
+        size_t j = i - HASH_MAP_PREFETCH_DIST;
+        if (i >= HASH_MAP_PREFETCH_DIST && j < n) prefetch_key(&hash_map->table, hash[j%HASH_MAP_BATCH_RING]);
+        size_t k = i - 2*HASH_MAP_PREFETCH_DIST;
+        if (i >= 2*HASH_MAP_PREFETCH_DIST) {
+            num += put_entry(hash_map, keys[k], keylens[k], hash[k%HASH_MAP_BATCH_RING], data?data[k]:NULL);
         }
-        if (++idx >= hash_map->capacity) idx = 0;
     }
+    OP_STAT(hash_map, inserts, num);
+    OP_STAT(hash_map, overwrites, n - num);
+    return num;
 }
 
 //ハッシュマップのデータ数
-int num_hash_map(hash_map_t *hash_map) {
+size_t num_hash_map(hash_map_t *hash_map) {
     return hash_map->num;
 }
 
-//イテレータ
-typedef struct iterator {
-    int         next_idx;
-    hash_map_t  *hash_map;
-} iterator_t;
+//ハッシュマップがこれまでに行ったメモリ確保の回数
+long alloc_count_hash_map(hash_map_t *hash_map) {
+    return hash_map->n_alloc;
+}
+
+//ハッシュマップの統計情報
+void stats_hash_map(hash_map_t *hash_map, hash_map_stats_t *stats) {
+    assert(hash_map);
+    assert(stats);
+    memset(stats, 0, sizeof(hash_map_stats_t));
+    stats->num = hash_map->num;
+    stats->capacity = hash_map->table.capacity;
+    stats->load_factor = (double)hash_map->num / hash_map->table.capacity;
+    stats->rehash_count = hash_map->rehash_count;
+    stats->rehash_sec = hash_map->rehash_ns * 1e-9;
+    if (hash_map->old.buckets) {
+        stats->rehashing = 1;
+        stats->old_capacity = hash_map->old.capacity;
+        stats->migrate_left = hash_map->migrate_left;
+    }
+    stats->key_bytes = hash_map->arena.live + hash_map->old_arena.live;
+    stats->dead_key_bytes = hash_map->arena.dead + hash_map->old_arena.dead;
+    stats->n_alloc = hash_map->n_alloc;
+    stats->evictions = hash_map->n_evict;
+    stats->huge_pages = hash_map->table.huge;
+#ifdef HASH_MAP_OP_STATS
+    stats->op_stats = 1;
+#endif
+    stats->hits = hash_map->hits;
+    stats->misses = hash_map->misses;
+    stats->inserts = hash_map->inserts;
+    stats->overwrites = hash_map->overwrites;
+    stats->deletes = hash_map->deletes;
+}
+
+//探索距離の統計情報
+//探索距離はエントリが保持するハッシュ値から求めるので、キーを読んだりハッシュ値を再計算したりしない。
+//リハッシュ中は旧バケット配列のエントリも旧配列での距離で数える。
+void probe_stats_hash_map(hash_map_t *hash_map, hash_map_probe_stats_t *probe) {
+    assert(hash_map);
+    assert(probe);
+    memset(probe, 0, sizeof(hash_map_probe_stats_t));
+    long long total = 0;
+    hash_table_t *tables[] = {&hash_map->table, &hash_map->old};
+    for (int t=0; t<2; t++) {
+        hash_table_t *table = tables[t];
+        for (size_t i=0; i<table->capacity; i++) {
+            if (!IS_FULL(table->ctrl[i])) continue;
+            int d = probe_dist(table, i);
+            probe->probe_hist[d < HASH_MAP_PROBE_HIST ? d : HASH_MAP_PROBE_HIST-1]++;
+            if (d > probe->max_probe) probe->max_probe = d;
+            total += d;
+        }
+    }
+    probe->avg_probe = hash_map->num ? (double)total / hash_map->num : 0;
+}
+
+//一括構築
+//テーブルを一度だけ確保し、キーをスレッドで分担して挿入する。各段階はrun_workersでスレッドを作成して実行する。
+//1. キーのハッシュ値を計算し、ホームのインデックスの上位ビットでパーティションに分ける
+//2. パーティション順にキーの番号を並べる（計数ソート）
+//3. パーティション（連続したバケットの範囲）毎に挿入する。範囲の末尾を越えるエントリは後で逐次挿入する
+#define BUILD_PART_MIN      1024    //パーティションの最小バケット数
+#define BUILD_PART_PER_THREAD 8     //スレッドあたりのパーティション数の目安
+
+//パーティションに収まらなかったエントリ
+typedef struct {
+    hash_entry_t entry;
+    uint8_t tag;
+} build_spill_t;
+
+//一括構築の共有データ
+typedef struct {
+    hash_map_t *hash_map;
+    const char *const *keys;
+    const int *keylens;
+    void *const *data;
+    size_t n;
+    int n_thread;
+    int n_part;             //パーティション数（2のべき乗）
+    int part_bits;          //log2(n_part)
+    uint64_t *hash;         //キーのハッシュ値
+    size_t *order;          //パーティション順に並べたキーの番号
+    size_t *counts;         //スレッド毎・パーティション毎のキー数（[n_thread][n_part]）
+    size_t *part_start;     //orderでのパーティションの先頭（n_part+1個）
+    _Atomic int next_part;  //次に挿入するパーティション
+} build_t;
+
+//一括構築のスレッド毎のデータ
+typedef struct {
+    build_t *build;
+    int id;
+    key_arena_t arena;      //スレッド毎のキーアリーナ（最後にハッシュマップのアリーナにつなぐ）
+    long n_alloc;
+    size_t num;             //追加したデータ数
+    build_spill_t *spill;
+    size_t n_spill;
+    size_t spill_size;
+} build_worker_t;
+
+//キーのパーティション（ホームのインデックスの上位ビット）
+static inline int build_part(build_t *build, uint64_t hash) {
+    hash_table_t *table = &build->hash_map->table;
+    return home_index(table, hash) >> (64 - table->shift - build->part_bits);
+}
+
+//パーティション内でキーを探す（範囲外は他のスレッドが書き込み中なので読まない）
+static hash_entry_t *build_find(hash_table_t *table, size_t end, const char *key, int keylen, uint64_t hash) {
+    uint8_t tag = HASH_TAG(hash);
+    uint32_t high = HASH_HIGH(hash);
+    for (size_t idx=home_index(table, hash); idx<end && table->ctrl[idx]!=CTRL_EMPTY; idx++) {
+        hash_entry_t *entry = &table->buckets[idx];
+        if (table->ctrl[idx]==tag && entry->hash==high && entry->keylen==keylen &&
+            memcmp(entry_key(table, entry), key, keylen)==0) return entry;
+    }
+    return NULL;
+}
+
+//パーティション内にRobin Hood法で挿入する（insert_entryと同じ）
+//endを越えるエントリはspillに追加する。
+static void build_insert(build_worker_t *worker, hash_table_t *table, size_t end, hash_entry_t entry, uint8_t tag) {
+    int dist = 0;
+    for (size_t idx=home_index(table, entry_hash(entry.hash, tag)); idx<end; idx++, dist++) {
+        if (table->ctrl[idx]==CTRL_EMPTY) {
+            set_ctrl(table, idx, tag);
+            table->buckets[idx] = entry;
+            return;
+        }
+        int d = probe_dist(table, idx);
+        if (d < dist) {
+            hash_entry_t tmp = table->buckets[idx];
+            uint8_t tmp_tag = table->ctrl[idx];
+            set_ctrl(table, idx, tag);
+            table->buckets[idx] = entry;
+            entry = tmp;
+            tag = tmp_tag;
+            dist = d;
+        }
+    }
+    if (worker->n_spill == worker->spill_size) {
+        worker->spill_size = worker->spill_size ? worker->spill_size*2 : 64;
+        worker->spill = realloc(worker->spill, worker->spill_size * sizeof(build_spill_t));
+        assert(worker->spill);
+    }
+    worker->spill[worker->n_spill++] = (build_spill_t){entry, tag};
+}
+
+//パーティションのキーを挿入する
+//同じキーは同じパーティションになるので、重複はパーティション内とそのspillだけで確認すればよい。
+static void build_partition(build_worker_t *worker, int part) {
+    build_t *build = worker->build;
+    hash_table_t *table = &build->hash_map->table;
+    size_t end = (part + 1) * (table->capacity / build->n_part);
+    size_t spill_begin = worker->n_spill;
+    for (size_t j=build->part_start[part]; j<build->part_start[part+1]; j++) {
+        size_t i = build->order[j];
+        const char *key = build->keys[i];
+        int keylen = build->keylens[i];
+        uint64_t hash = build->hash[i];
+        void *data = build->data ? build->data[i] : NULL;
+        hash_entry_t *found = build_find(table, end, key, keylen, hash);
+        for (size_t k=spill_begin; !found && k<worker->n_spill; k++) {
+            hash_entry_t *entry = &worker->spill[k].entry;
+            if (entry->hash==HASH_HIGH(hash) && entry->keylen==keylen && memcmp(entry_key(table, entry), key, keylen)==0) found = entry;
+        }
+        if (found) {
+            found->data = data;
+            continue;
+        }
+        hash_entry_t entry;
+        set_entry(&worker->arena, &worker->n_alloc, &entry, key, keylen, hash, data);
+        build_insert(worker, table, end, entry, HASH_TAG(hash));
+        worker->num++;
+    }
+}
+
+//ワーカー毎にfunc(&args[t])を並列に実行する（argsはsizeバイトの要素n個の配列）
+//スレッドを作成できなかった分は呼び出したスレッドで順に実行するので、すべての要素が必ず1回実行される。
+static void run_workers(void *(*func)(void*), void *args, size_t size, int n) {
+    pthread_t *th = malloc(n * sizeof(pthread_t));
+    int *started = calloc(n, sizeof(int));
+    assert(th && started);
+    for (int t=1; t<n; t++) started[t] = pthread_create(&th[t], NULL, func, (char*)args + t*size)==0;
+    func(args);
+    for (int t=1; t<n; t++) {
+        if (started[t]) pthread_join(th[t], NULL);
+        else func((char*)args + t*size);
+    }
+    free(th);
+    free(started);
+}
+
+//ワーカーが担当するキーの範囲
+static inline void build_range(build_worker_t *worker, size_t *begin, size_t *end) {
+    build_t *build = worker->build;
+    *begin = build->n * worker->id / build->n_thread;
+    *end = build->n * (worker->id + 1) / build->n_thread;
+}
+
+//ハッシュ値の計算
+static void *build_hash_worker(void *p) {
+    build_worker_t *worker = p;
+    build_t *build = worker->build;
+    size_t begin, end;
+    build_range(worker, &begin, &end);
+    size_t *counts = &build->counts[worker->id * build->n_part];
+    for (size_t i=begin; i<end; i++) {
+        uint64_t hash = hash_key(build->hash_map, build->keys[i], build->keylens[i]);
+        build->hash[i] = hash;
+        counts[build_part(build, hash)]++;
+    }
+    return NULL;
+}
+
+//パーティション順に並べる（書き込み位置は前のパーティションと、同じパーティションの前のスレッドの後ろ）
+static void *build_order_worker(void *p) {
+    build_worker_t *worker = p;
+    build_t *build = worker->build;
+    size_t begin, end;
+    build_range(worker, &begin, &end);
+    size_t *offset = malloc(build->n_part * sizeof(size_t));
+    assert(offset);
+    size_t pos = 0;
+    for (int part=0; part<build->n_part; part++) {
+        if (worker->id==0) build->part_start[part] = pos;
+        for (int t=0; t<build->n_thread; t++) {
+            if (t==worker->id) offset[part] = pos;
+            pos += build->counts[t * build->n_part + part];
+        }
+    }
+    if (worker->id==0) build->part_start[build->n_part] = pos;
+    for (size_t i=begin; i<end; i++) build->order[offset[build_part(build, build->hash[i])]++] = i;
+    free(offset);
+    return NULL;
+}
+
+//パーティション毎の挿入
+static void *build_insert_worker(void *p) {
+    build_worker_t *worker = p;
+    build_t *build = worker->build;
+    int part;
+    while ((part = atomic_fetch_add(&build->next_part, 1)) < build->n_part) build_partition(worker, part);
+    return NULL;
+}
+
+//キーの配列からハッシュマップを一括で作成する
+hash_map_t *build_hash_map(const hash_map_config_t *config, const char *const *keys, const int *keylens, void *const *data, size_t n, int n_thread) {
+    assert(config);
+    assert(!(config->flags & HASH_MAP_CACHE));
+    assert(n==0 || (keys && keylens));
+    if (n_thread <= 0) n_thread = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_thread <= 0) n_thread = 1;
+
+    //データ数がlimitを超えないサイズで確保する
+    hash_map_config_t build_config = *config;
+    size_t size = n * 100 / HASH_MAP_MAX_CAPACITY + 1;
+    if (build_config.init_size < size) build_config.init_size = size;
+    hash_map_t *hash_map = new_hash_map_config(&build_config);
+    hash_table_t *table = &hash_map->table;
+    if (n==0) return hash_map;
+
+    build_t build = {.hash_map = hash_map, .keys = keys, .keylens = keylens, .data = data, .n = n, .n_thread = n_thread, .n_part = 1};
+    while (build.n_part < n_thread * BUILD_PART_PER_THREAD && table->capacity / (build.n_part * 2) >= BUILD_PART_MIN) {
+        build.n_part *= 2;
+        build.part_bits++;
+    }
+    build.hash = malloc(n * sizeof(uint64_t));
+    build.order = malloc(n * sizeof(size_t));
+    build.counts = calloc(n_thread * build.n_part, sizeof(size_t));
+    build.part_start = malloc((build.n_part + 1) * sizeof(size_t));
+    build_worker_t *workers = calloc(n_thread, sizeof(build_worker_t));
+    assert(build.hash && build.order && build.counts && build.part_start && workers);
+
+    //呼び出したスレッドもワーカー0として参加する
+    for (int t=0; t<n_thread; t++) {
+        workers[t].build = &build;
+        workers[t].id = t;
+        workers[t].arena.allocator = &hash_map->allocator;
+    }
+    run_workers(build_hash_worker, workers, sizeof(build_worker_t), n_thread);
+    run_workers(build_order_worker, workers, sizeof(build_worker_t), n_thread);
+    run_workers(build_insert_worker, workers, sizeof(build_worker_t), n_thread);
+
+    //パーティションに収まらなかったエントリを挿入し、キーアリーナをつなぐ
+    for (int t=0; t<n_thread; t++) {
+        build_worker_t *worker = &workers[t];
+        for (size_t i=0; i<worker->n_spill; i++) insert_entry(table, worker->spill[i].entry, worker->spill[i].tag);
+        free(worker->spill);
+        if (worker->arena.head) {
+            arena_chunk_t *tail = worker->arena.head;
+            while (tail->next) tail = tail->next;
+            tail->next = hash_map->arena.head;
+            hash_map->arena.head = worker->arena.head;
+            hash_map->arena.live += worker->arena.live;
+        }
+        hash_map->n_alloc += worker->n_alloc;
+        hash_map->num += worker->num;
+    }
+
+    free(build.hash);
+    free(build.order);
+    free(build.counts);
+    free(build.part_start);
+    free(workers);
+    return hash_map;
+}
+
+//マージ
+//マージ先のバケット配列をマージ後のデータ数に合わせて一度だけ確保し直し、一括構築と同じようにスレッドで分担して挿入する。
+//1. マージ先の旧バケット配列とマージ元のバケット配列をスレッド毎の範囲に分け、エントリを新しいバケット配列の
+//   ホームのインデックスの上位ビットでパーティションに分ける（ソルトはマップ毎に違うので、マージ元の順番は使えない）
+//2. パーティション、マージ元、スレッドの順にエントリを並べる（計数ソート）
+//3. パーティション毎に挿入する。同じキーはマージ元の順に現れる
+//エントリはハッシュ値の上位ビットとタグを保持しているので、キーを読むのは重複の確認だけ。
+//長いキーはアリーナのチャンクごとマージ先に移す。
+
+//パーティションに分けたエントリ
+typedef struct {
+    hash_entry_t *entry;    //マージ元のエントリ
+    uint8_t tag;
+} merge_item_t;
+
+//マージの共有データ
+typedef struct {
+    hash_table_t **srcs;    //マージ先の旧バケット配列とマージ元のバケット配列
+    int n_src;
+    hash_table_t *table;    //マージ先の新しいバケット配列
+    int n_thread;
+    int n_part;             //パーティション数（2のべき乗）
+    int part_bits;          //log2(n_part)
+    hash_map_combine_t combine;
+    void *arg;
+    size_t *counts;         //マージ元毎・スレッド毎・パーティション毎のエントリ数（[n_src][n_thread][n_part]、並べる前に書き込み位置にする）
+    size_t *part_start;     //itemsでのパーティションの先頭（n_part+1個）
+    merge_item_t *items;    //パーティション順に並べたエントリ
+    _Atomic int next_part;  //次に挿入するパーティション
+} merge_t;
+
+//マージのスレッド毎のデータ
+typedef struct {
+    build_worker_t worker;  //パーティションに収まらなかったエントリ（spill）
+    merge_t *merge;
+    int id;
+    size_t num;             //追加したデータ数
+    size_t dead;            //重複したため不要になった長いキーのバイト数
+} merge_worker_t;
+
+//エントリのパーティション（新しいバケット配列でのホームのインデックスの上位ビット）
+static inline int merge_part(merge_t *merge, hash_table_t *src, size_t idx) {
+    size_t home = home_index(merge->table, entry_hash(src->buckets[idx].hash, src->ctrl[idx]));
+    return home >> (64 - merge->table->shift - merge->part_bits);
+}
+
+//パーティションに分ける
+//並べる場合は(*counts)を書き込み位置として使う。
+static void merge_scan(merge_worker_t *mw, int order) {
+    merge_t *merge = mw->merge;
+    for (int s=0; s<merge->n_src; s++) {
+        hash_table_t *src = merge->srcs[s];
+        size_t begin = src->capacity * mw->id / merge->n_thread;
+        size_t end = src->capacity * (mw->id + 1) / merge->n_thread;
+        size_t *counts = &merge->counts[((size_t)s * merge->n_thread + mw->id) * merge->n_part];
+        for (size_t idx=begin; idx<end; idx++) {
+            if (!IS_FULL(src->ctrl[idx])) continue;
+            int part = merge_part(merge, src, idx);
+            if (order) merge->items[counts[part]++] = (merge_item_t){&src->buckets[idx], src->ctrl[idx]};
+            else counts[part]++;
+        }
+    }
+}
+static void *merge_count_worker(void *p) {
+    merge_scan(p, 0);
+    return NULL;
+}
+static void *merge_order_worker(void *p) {
+    merge_scan(p, 1);
+    return NULL;
+}
+
+//マージ元のエントリをマージ先のパーティションに挿入する
+//重複したキーはcombineで結合し（NULLの場合は後のデータ）、マージ元のキーは不要になる。
+//マージ元はスナップショットではないので、キーとデータはマージ先と同じように参照できる。
+static void merge_entry(merge_worker_t *mw, size_t end, size_t spill_begin, merge_item_t *item) {
+    merge_t *merge = mw->merge;
+    hash_table_t *table = merge->table;
+    hash_entry_t entry = *item->entry;
+    char *key = entry_key(table, &entry);
+    uint64_t hash = entry_hash(entry.hash, item->tag);
+    hash_entry_t *found = build_find(table, end, key, entry.keylen, hash);
+    for (size_t k=spill_begin; !found && k<mw->worker.n_spill; k++) {
+        hash_entry_t *e = &mw->worker.spill[k].entry;
+        if (e->hash==entry.hash && e->keylen==entry.keylen && memcmp(entry_key(table, e), key, entry.keylen)==0) found = e;
+    }
+    if (found) {
+        found->data = merge->combine ? merge->combine(found->data, entry.data, merge->arg) : entry.data;
+        if (entry.keylen>HASH_KEY_INLINE_SIZE) mw->dead += entry.keylen;
+        return;
+    }
+    build_insert(&mw->worker, table, end, entry, item->tag);
+    mw->num++;
+}
+
+//パーティション毎の挿入
+static void *merge_insert_worker(void *p) {
+    merge_worker_t *mw = p;
+    merge_t *merge = mw->merge;
+    int part;
+    while ((part = atomic_fetch_add(&merge->next_part, 1)) < merge->n_part) {
+        size_t end = (part + 1) * (merge->table->capacity / merge->n_part);
+        size_t spill_begin = mw->worker.n_spill;
+        for (size_t j=merge->part_start[part]; j<merge->part_start[part+1]; j++) merge_entry(mw, end, spill_begin, &merge->items[j]);
+    }
+    return NULL;
+}
+
+//ハッシュマップをdstにマージする
+void merge_hash_map(hash_map_t *dst, hash_map_t *const *srcs, int n, hash_map_combine_t combine, void *arg, int n_thread) {
+    assert(dst);
+    assert(!dst->mapping && !(dst->flags & HASH_MAP_CACHE));
+    assert(n==0 || srcs);
+    if (n_thread <= 0) n_thread = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_thread <= 0) n_thread = 1;
+
+    //エントリのハッシュ値をそのまま使い、キーのチャンクをdstのアロケータで解放するので、どちらも同じであること
+    finish_rehash(dst);
+    size_t total = dst->num;
+    for (int s=0; s<n; s++) {
+        hash_map_t *src = srcs[s];
+        assert(src && src != dst);
+        assert(!src->mapping && !(src->flags & HASH_MAP_CACHE));
+        assert(src->hash_func==dst->hash_func && src->hash64_func==dst->hash64_func);
+        assert(src->allocator.alloc==dst->allocator.alloc && src->allocator.free==dst->allocator.free && src->allocator.arg==dst->allocator.arg);
+        finish_rehash(src);
+        total += src->num;
+    }
+
+    //重複がなくてもリハッシュしないサイズで新しいバケット配列を確保する
+    size_t capacity = capacity_for(total);
+    if (capacity < dst->table.capacity) capacity = dst->table.capacity;
+    hash_table_t old = dst->table;
+    alloc_buckets(dst, &dst->table, capacity);
+    hash_table_t *table = &dst->table;
+    hash_table_t **tables = malloc((n + 1) * sizeof(hash_table_t*));
+    assert(tables);
+    tables[0] = &old;
+    for (int s=0; s<n; s++) tables[s+1] = &srcs[s]->table;
+
+    merge_t merge = {.srcs = tables, .n_src = n + 1, .table = table, .n_thread = n_thread, .n_part = 1, .combine = combine, .arg = arg};
+    while (merge.n_part < n_thread * BUILD_PART_PER_THREAD && table->capacity / (merge.n_part * 2) >= BUILD_PART_MIN) {
+        merge.n_part *= 2;
+        merge.part_bits++;
+    }
+    size_t n_count = (size_t)merge.n_src * n_thread * merge.n_part;
+    merge.counts = calloc(n_count, sizeof(size_t));
+    merge.part_start = malloc((merge.n_part + 1) * sizeof(size_t));
+    merge.items = malloc(total * sizeof(merge_item_t));
+    merge_worker_t *workers = calloc(n_thread, sizeof(merge_worker_t));
+    assert(merge.counts && merge.part_start && merge.items && workers);
+
+    //呼び出したスレッドもワーカー0として参加する
+    for (int t=0; t<n_thread; t++) {
+        workers[t].merge = &merge;
+        workers[t].id = t;
+    }
+    run_workers(merge_count_worker, workers, sizeof(merge_worker_t), n_thread);
+
+    //パーティション、マージ元、スレッドの順の書き込み位置にする
+    size_t pos = 0;
+    for (int part=0; part<merge.n_part; part++) {
+        merge.part_start[part] = pos;
+        for (size_t i=part; i<n_count; i+=merge.n_part) {
+            size_t count = merge.counts[i];
+            merge.counts[i] = pos;
+            pos += count;
+        }
+    }
+    merge.part_start[merge.n_part] = pos;
+    run_workers(merge_order_worker, workers, sizeof(merge_worker_t), n_thread);
+    run_workers(merge_insert_worker, workers, sizeof(merge_worker_t), n_thread);
+
+    //パーティションに収まらなかったエントリを挿入する
+    size_t dead = 0;
+    dst->num = 0;
+    for (int t=0; t<n_thread; t++) {
+        build_worker_t *worker = &workers[t].worker;
+        for (size_t i=0; i<worker->n_spill; i++) insert_entry(table, worker->spill[i].entry, worker->spill[i].tag);
+        free(worker->spill);
+        dst->num += workers[t].num;
+        dead += workers[t].dead;
+    }
+    dst->limit = table->capacity * HASH_MAP_MAX_CAPACITY / 100;
+    free_buckets(dst, &old);
+
+    //マージ元のキーアリーナをdstにつなぎ、マージ元は空にする
+    for (int s=0; s<n; s++) {
+        hash_map_t *src = srcs[s];
+        if (src->arena.head) {
+            arena_chunk_t *tail = src->arena.head;
+            while (tail->next) tail = tail->next;
+            tail->next = dst->arena.head;
+            dst->arena.head = src->arena.head;
+        }
+        dst->arena.live += src->arena.live;
+        dst->arena.dead += src->arena.dead;
+        src->arena.head = NULL;
+        src->arena.live = src->arena.dead = 0;
+        free_buckets(src, &src->table);
+        alloc_buckets(src, &src->table, HASH_MAP_INIT_SIZE);
+        src->num = 0;
+        src->limit = HASH_MAP_INIT_SIZE * HASH_MAP_MAX_CAPACITY / 100;
+    }
+    dst->arena.live -= dead;
+    dst->arena.dead += dead;
+
+    free(tables);
+    free(merge.counts);
+    free(merge.part_start);
+    free(merge.items);
+    free(workers);
+    if (NEED_COMPACT(dst->arena)) compact_arena(dst);
+}
 
 //ハッシュマップのイテレータを生成する。
+//リハッシュ中であれば先に完了させる。
 iterator_t *iterate_hash_map(hash_map_t *hash_map) {
-    assert(hash_map);
-    iterator_t *iterator = calloc(1, sizeof(iterator_t));
+    iterator_t *iterator = malloc(sizeof(iterator_t));
     assert(iterator);
-    iterator->hash_map = hash_map;
+    init_iterate(iterator, hash_map);
     return iterator;
 }
 
+//イテレータを初期化する（スタック上などに確保したイテレータ用）。
+//リハッシュ中であれば先に完了させる。
+void init_iterate(iterator_t *iterator, hash_map_t *hash_map) {
+    assert(iterator);
+    assert(hash_map);
+    finish_rehash(hash_map);
+    iterator->hash_map = hash_map;
+    iterator->next_idx = 0;
+    iterator->end_idx = hash_map->table.capacity;
+}
+
+//バケット配列をn個の範囲に分割してイテレータを初期化する。
+//それぞれの範囲は重ならないので、別々のスレッドでイテレートできる。
+void split_iterate_hash_map(hash_map_t *hash_map, iterator_t *iterators, int n) {
+    assert(hash_map);
+    assert(iterators && n > 0);
+    finish_rehash(hash_map);
+    size_t capacity = hash_map->table.capacity;
+    for (int i=0; i<n; i++) {
+        iterators[i].hash_map = hash_map;
+        iterators[i].next_idx = capacity * i / n;
+        iterators[i].end_idx = capacity * (i+1) / n;
+    }
+}
+
 //次のデータをkey,dataに設定して1を返す。key、dataにNULL指定可能。
 //次のデータがない場合は0を返す。
 //イテレートする順番はランダム。
+//制御バイトをGROUP_SIZE個ずつ調べて、未使用のバケットを読み飛ばす。
+//末尾のグループは先頭のミラーにかかるが、end_idx以降は使わない。
 int next_iterate(iterator_t* iterator, char **key, int *keylen, void **data) {
     assert(iterator);
-    hash_map_t *hash_map = iterator->hash_map;
-    for (; iterator->next_idx < hash_map->capacity; iterator->next_idx++) {
-        hash_entry_t *hash_entry = &hash_map->buckets[iterator->next_idx];
-        if (hash_entry->key && hash_entry->key!=TOMBSTONE) {
-            if (key)    *key    = hash_entry->key;
-            if (keylen) *keylen = hash_entry->keylen;
-            if (data)   *data   = hash_entry->data;
-            iterator->next_idx++;
-            return 1;
+    hash_table_t *table = &iterator->hash_map->table;
+    size_t idx = iterator->next_idx;
+    size_t end = iterator->end_idx;
+    while (idx < end) {
+        uint32_t full = ~group_match_empty(group_load(&table->ctrl[idx])) & ((1u << GROUP_SIZE) - 1);
+        if (!full) {
+            idx += GROUP_SIZE;
+            continue;
         }
+        idx += __builtin_ctz(full);
+        if (idx >= end) break;
+        hash_entry_t *hash_entry = &table->buckets[idx];
+        if (key)    *key    = entry_key(table, hash_entry);
+        if (keylen) *keylen = hash_entry->keylen;
+        if (data)   *data   = entry_data(table, hash_entry);
+        iterator->next_idx = idx + 1;
+        return 1;
     }
+    iterator->next_idx = end;
     return 0;
 }
 
@@ -264,34 +1677,768 @@ void end_iterate(iterator_t* iterator) {
     free(iterator);
 }
 
+//スナップショットのファイル形式
+//ヘッダ、バケット配列（制御バイトを含め、メモリ上と同じ配置）、キーとデータの領域の順に並べる。
+//エントリの長いキーとシリアライズしたデータは、ポインタの代わりに領域内のオフセットを保持する。
+//エンディアンとhash_entry_tの配置が同じ環境でのみ読み込める。
+#define HASH_MAP_FILE_MAGIC     "HASHMAP"
+#define HASH_MAP_FILE_VERSION   2
+#define HASH_MAP_FILE_ALIGN     64      //バケット配列と領域の先頭の境界
+#define HASH_MAP_FILE_DATA      0x01    //データをシリアライズした
+#define HASH_MAP_SAVE_CHUNK     1024    //一度に書き込むエントリ数
+#define FILE_ALIGN(n)   (((n) + HASH_MAP_FILE_ALIGN - 1) & ~(uint64_t)(HASH_MAP_FILE_ALIGN - 1))
+typedef struct {
+    char magic[8];          //HASH_MAP_FILE_MAGIC
+    uint32_t version;       //HASH_MAP_FILE_VERSION
+    uint32_t entry_size;    //sizeof(hash_entry_t)
+    uint64_t hash_check;    //ハッシュ関数の確認用（HASH_MAP_FILE_MAGICのハッシュ値）
+    uint64_t flags;         //HASH_MAP_FILE_DATA
+    uint64_t capacity;      //バケット数
+    uint64_t num;           //データ数
+    uint64_t table_off;     //バケット配列の位置
+    uint64_t blob_off;      //キーとデータの領域の位置
+    uint64_t blob_size;     //キーとデータの領域のサイズ
+    uint64_t seed;          //ハッシュマップのソルト（ホームのインデックスが変わらないように引き継ぐ）
+} hash_map_file_t;
+
+//ハッシュマップをファイルに保存する
+//バケット配列はチャンク毎にオフセットに書き換えて書き込み、キーとデータは別のFILEで領域に追記する。
+int save_hash_map(hash_map_t *hash_map, const char *path, hash_map_save_data_t save_data, void *arg) {
+    assert(hash_map);
+    assert(path);
+    finish_rehash(hash_map);
+    hash_table_t *table = &hash_map->table;
+    size_t ctrl_size = table->capacity + GROUP_SIZE - 1;
+    hash_map_file_t header = {.magic = HASH_MAP_FILE_MAGIC, .version = HASH_MAP_FILE_VERSION, .entry_size = sizeof(hash_entry_t)};
+    header.hash_check = hash_key(hash_map, HASH_MAP_FILE_MAGIC, sizeof(HASH_MAP_FILE_MAGIC));
+    header.flags = save_data ? HASH_MAP_FILE_DATA : 0;
+    header.capacity = table->capacity;
+    header.num = hash_map->num;
+    header.seed = hash_map->seed;
+    header.table_off = FILE_ALIGN(sizeof(hash_map_file_t));
+    header.blob_off = FILE_ALIGN(header.table_off + table->capacity * sizeof(hash_entry_t) + ctrl_size);
+
+    int ret = -1;
+    hash_entry_t *chunk = malloc(HASH_MAP_SAVE_CHUNK * sizeof(hash_entry_t));
+    assert(chunk);
+    FILE *fp = fopen(path, "wb");
+    FILE *blob = fp ? fopen(path, "r+b") : NULL;
+    if (!blob || fseek(fp, header.table_off, SEEK_SET) || fseek(blob, header.blob_off, SEEK_SET)) goto end;
+    for (size_t i=0; i<table->capacity; i+=HASH_MAP_SAVE_CHUNK) {
+        int n = table->capacity-i < HASH_MAP_SAVE_CHUNK ? table->capacity-i : HASH_MAP_SAVE_CHUNK;
+        for (int j=0; j<n; j++) {
+            hash_entry_t *entry = &chunk[j];
+            if (!IS_FULL(table->ctrl[i+j])) {
+                memset(entry, 0, sizeof(hash_entry_t));
+                continue;
+            }
+            *entry = table->buckets[i+j];
+            if (entry->keylen>HASH_KEY_INLINE_SIZE) {
+                if (fwrite(entry_key(table, &table->buckets[i+j]), 1, entry->keylen, blob) != (size_t)entry->keylen) goto end;
+                entry->key.ptr = (char*)(uintptr_t)header.blob_size;
+                header.blob_size += entry->keylen;
+            }
+            if (save_data) {
+                //データは8バイト境界に置く
+                static const char pad[8];
+                size_t size = 0;
+                const void *p = save_data(entry->data, &size, arg);
+                size_t padding = -header.blob_size & 7;
+                if (fwrite(pad, 1, padding, blob) != padding || fwrite(p, 1, size, blob) != size) goto end;
+                entry->data = (void*)(uintptr_t)(header.blob_size + padding);
+                header.blob_size += padding + size;
+            }
+        }
+        if (fwrite(chunk, sizeof(hash_entry_t), n, fp) != (size_t)n) goto end;
+    }
+    if (fwrite(table->ctrl, 1, ctrl_size, fp) != ctrl_size) goto end;
+    if (fseek(fp, 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, fp) != 1) goto end;
+    //領域が空でもファイルはblob_off+blob_sizeまで伸ばす（読み込み時にファイルサイズと比べるため）
+    if (fflush(blob) || fflush(fp) || ftruncate(fileno(fp), header.blob_off + header.blob_size)) goto end;
+    ret = 0;
+end:
+    free(chunk);
+    if (blob && fclose(blob)) ret = -1;
+    if (fp && fclose(fp)) ret = -1;
+    return ret;
+}
+
+//読み込んだバケット配列を確認する（HASH_MAP_VERIFY）
+//制御バイトは空か7ビットのタグでミラーが一致し、空のバケットが残っていること（探索が止まる）、
+//長いキーとシリアライズしたデータのオフセットが領域内にあることを確かめる。
+static int check_snapshot(hash_table_t *table, const hash_map_file_t *header) {
+    for (int i=0; i<GROUP_SIZE-1; i++) {
+        if (table->ctrl[table->capacity + i] != table->ctrl[i]) return 0;
+    }
+    uint64_t num = 0;
+    for (size_t i=0; i<table->capacity; i++) {
+        uint8_t c = table->ctrl[i];
+        if (c == CTRL_EMPTY) continue;
+        if (!IS_FULL(c)) return 0;
+        num++;
+        const hash_entry_t *entry = &table->buckets[i];
+        if (entry->keylen < 0) return 0;
+        if (entry->keylen>HASH_KEY_INLINE_SIZE) {
+            uint64_t off = (uintptr_t)entry->key.ptr;
+            if (off > header->blob_size || (uint64_t)entry->keylen > header->blob_size - off) return 0;
+        }
+        if (header->flags & HASH_MAP_FILE_DATA) {
+            uint64_t off = (uintptr_t)entry->data;
+            if (off > header->blob_size || (off & 7)) return 0;
+        }
+    }
+    return num == header->num && num < table->capacity;
+}
+
+//保存したファイルをマップしてハッシュマップを作成する
+//バケット配列はマップした領域をそのまま使い、キーとデータはkey_base/data_baseで参照する。
+hash_map_t *load_hash_map(const char *path, const hash_map_config_t *config) {
+    assert(path);
+    assert(config);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st)==0 && (size_t)st.st_size >= sizeof(hash_map_file_t)) {
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+
+    hash_map_t *hash_map = calloc(1, sizeof(hash_map_t));
+    assert(hash_map);
+    hash_map->hash_func = config->hash_func?config->hash_func:fnv1a_hash;
+    hash_map->hash64_func = config->hash64_func;
+    hash_map->n_alloc = 1;
+    hash_map->mapping = p;
+    hash_map->mapping_size = st.st_size;
+
+    //ヘッダを確認する
+    hash_map_file_t *header = p;
+    uint64_t capacity = header->capacity;
+    if (memcmp(header->magic, HASH_MAP_FILE_MAGIC, sizeof(header->magic)) || header->version != HASH_MAP_FILE_VERSION ||
+        header->entry_size != sizeof(hash_entry_t) ||
+        header->hash_check != hash_key(hash_map, HASH_MAP_FILE_MAGIC, sizeof(HASH_MAP_FILE_MAGIC)) ||
+        capacity < HASH_MAP_INIT_SIZE || capacity > HASH_MAP_MAX_BUCKETS || (capacity & (capacity - 1)) ||
+        header->table_off % HASH_MAP_FILE_ALIGN || header->blob_off % HASH_MAP_FILE_ALIGN ||
+        header->table_off > (uint64_t)st.st_size ||
+        capacity * (sizeof(hash_entry_t) + 1) + GROUP_SIZE - 1 > (uint64_t)st.st_size - header->table_off ||
+        header->blob_off > (uint64_t)st.st_size || header->blob_size > (uint64_t)st.st_size - header->blob_off) {
+        free_hash_map(hash_map);
+        return NULL;
+    }
+
+    hash_table_t *table = &hash_map->table;
+    table->capacity = capacity;
+    table->mask = capacity - 1;
+    table->shift = 64 - __builtin_ctzll(capacity);
+    table->seed = hash_map->seed = header->seed;
+    table->buckets = (hash_entry_t*)((char*)p + header->table_off);
+    table->ctrl = (uint8_t*)(table->buckets + capacity);
+    table->key_base = (uintptr_t)p + header->blob_off;
+    table->data_base = (header->flags & HASH_MAP_FILE_DATA) ? table->key_base : 0;
+    hash_map->num = header->num;
+    hash_map->limit = capacity * HASH_MAP_MAX_CAPACITY / 100;
+    if ((config->flags & HASH_MAP_VERIFY) && !check_snapshot(table, header)) {
+        free_hash_map(hash_map);
+        return NULL;
+    }
+    madvise(p, st.st_size, MADV_RANDOM);
+    return hash_map;
+}
+
+//シャーディングしたハッシュマップ
+//シャード毎に読み書きロックとハッシュマップを持つ。
+//シャードはハッシュ値のビット16-24で選ぶ（上位ビットはシャード内のインデックスに使うので避ける）。
+#define SHARD_SHIFT     16
+#define SHARD_MAX       512
+typedef struct {
+    pthread_rwlock_t lock;
+    hash_map_t hash_map;
+} __attribute__((aligned(64))) shard_t;
+
+typedef struct shard_hash_map {
+    int n_shard;            //シャード数（2のべき乗）
+    shard_t *shards;
+} shard_hash_map_t;
+
+//キーのハッシュ値とシャード
+static inline shard_t *key_shard(shard_hash_map_t *shard_map, const char *key, int keylen, uint64_t *hash) {
+    *hash = hash_key(&shard_map->shards[0].hash_map, key, keylen);
+    return &shard_map->shards[(*hash >> SHARD_SHIFT) & (shard_map->n_shard - 1)];
+}
+
+//シャーディングしたハッシュマップを作成する。
+shard_hash_map_t *new_shard_hash_map(int n_shard, const hash_map_config_t *config) {
+    assert(config);
+    assert(!(config->flags & HASH_MAP_CACHE));  //getが参照ビットを書き込むので読み込みロックでは使えない
+    shard_hash_map_t *shard_map = calloc(1, sizeof(shard_hash_map_t));
+    assert(shard_map);
+    int n = 1;
+    while (n < n_shard && n < SHARD_MAX) n *= 2;
+    shard_map->n_shard = n;
+    shard_map->shards = aligned_alloc(64, n * sizeof(shard_t));
+    assert(shard_map->shards);
+    hash_map_config_t shard_config = *config;
+    shard_config.init_size = config->init_size / n;
+    for (int i=0; i<n; i++) {
+        init_hash_map(&shard_map->shards[i].hash_map, &shard_config);
+        pthread_rwlock_init(&shard_map->shards[i].lock, NULL);
+    }
+    return shard_map;
+}
+
+//シャーディングしたハッシュマップをフリーする。
+void free_shard_hash_map(shard_hash_map_t *shard_map) {
+    if (shard_map) {
+        for (int i=0; i<shard_map->n_shard; i++) {
+            release_hash_map(&shard_map->shards[i].hash_map);
+            pthread_rwlock_destroy(&shard_map->shards[i].lock);
+        }
+        free(shard_map->shards);
+    }
+    free(shard_map);
+}
+
+//データ書き込み（put_hash_mapと同じ）
+int put_shard_hash_map(shard_hash_map_t *shard_map, const char *key, int keylen, void *data) {
+    assert(shard_map);
+    assert(key);
+    uint64_t hash;
+    shard_t *shard = key_shard(shard_map, key, keylen, &hash);
+    pthread_rwlock_wrlock(&shard->lock);
+    hash_map_t *hash_map = &shard->hash_map;
+    if (hash_map->old.buckets) migrate_buckets(hash_map, HASH_MAP_MIGRATE_BUCKETS);
+    int ret = put_entry(hash_map, key, keylen, hash, data);
+    pthread_rwlock_unlock(&shard->lock);
+    return ret;
+}
+
+//キーに対応するデータの取得（get_hash_mapと同じ）
+//読み込みロックなので同じシャードでも並行して検索できる。
+//HASH_MAP_INCREMENTALでも検索ではバケットを移動しない。
+int get_shard_hash_map(shard_hash_map_t *shard_map, const char *key, int keylen, void **data) {
+    assert(shard_map);
+    assert(key);
+    uint64_t hash;
+    shard_t *shard = key_shard(shard_map, key, keylen, &hash);
+    pthread_rwlock_rdlock(&shard->lock);
+    int ret = get_entry(&shard->hash_map, key, keylen, hash, data);
+    pthread_rwlock_unlock(&shard->lock);
+    return ret;
+}
+
+//データの削除（del_hash_mapと同じ）
+int del_shard_hash_map(shard_hash_map_t *shard_map, const char *key, int keylen) {
+    assert(shard_map);
+    assert(key);
+    uint64_t hash;
+    shard_t *shard = key_shard(shard_map, key, keylen, &hash);
+    pthread_rwlock_wrlock(&shard->lock);
+    hash_map_t *hash_map = &shard->hash_map;
+    if (hash_map->old.buckets) migrate_buckets(hash_map, HASH_MAP_MIGRATE_BUCKETS);
+    int ret = del_entry(hash_map, key, keylen, hash);
+    pthread_rwlock_unlock(&shard->lock);
+    return ret;
+}
+
+//ハッシュマップのデータ数（全シャードの合計）
+size_t num_shard_hash_map(shard_hash_map_t *shard_map) {
+    size_t num = 0;
+    for (int i=0; i<shard_map->n_shard; i++) {
+        shard_t *shard = &shard_map->shards[i];
+        pthread_rwlock_rdlock(&shard->lock);
+        num += shard->hash_map.num;
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    return num;
+}
+
+//ロックフリーのハッシュマップ
+//Cliff Clickのロックフリーハッシュテーブルと同様に、スロット毎にキーと値をCASで更新する。
+//- キーはCASでスロットを確保し、以後そのスロットのキーは変わらない
+//- 削除はデータをLF_TOMBにする（論理削除）。削除済みのキーはリサイズ時に捨てる
+//- リサイズは新テーブルを作成し、putするスレッドがチャンク単位で協調してコピーする
+//- コピー中のスロットは値にLF_PRIMEを付けて凍結し、新テーブルにコピーした後LF_MOVEDにする
+//- getはテーブルに書き込まず、ロックも取らない（EBRのエポックを自スレッドのレコードに通知するだけ）
+//- 旧テーブルと不要になったキーはEBR（エポックベースの回収）で解放する
+#define LF_MAX_LOAD     50          //使用率（削除済みキーも含む）がこれを超えたらリサイズする
+#define LF_COPY_CHUNK   1024        //協調コピーで1回に担当するスロット数
+#define LF_REPROBE_LIMIT(capacity)  (10 + ((capacity) >> 2))   //これ以上探索したら新テーブルに移る
+
+//スロットの値
+//0: 未設定、LF_LIVE|data: データ、LF_TOMB: 削除済み
+//LF_PRIME|値: コピー中（凍結済み）、LF_MOVED: 新テーブルにコピー済み
+//LF_DEAD: コピー不要（キーは他のテーブルが所有）、LF_DROP: コピー不要（キーはこのテーブルと一緒に解放する）
+#define LF_PRIME        (1ULL << 63)
+#define LF_LIVE         (1ULL << 62)
+#define LF_DATA_MASK    (LF_LIVE - 1)
+#define LF_TOMB         1ULL
+#define LF_MOVED        2ULL
+#define LF_DEAD         3ULL
+#define LF_DROP         4ULL
+#define LF_COPIED(v)    ((v) >= LF_MOVED && (v) <= LF_DROP)
+
+struct lf_table;
+
+//ロックフリー版のキー（スロットに設定した後は変更しない）
+typedef struct {
+    _Atomic(struct lf_table*) owner;    //キーを所有する（データを持つ）テーブル
+    uint64_t hash;          //ハッシュ値
+    int keylen;             //キーの長さ
+    char key[];             //キー本体
+} lf_key_t;
+
+//空きスロットをコピーした印（以後このスロットは使用しない）
+static lf_key_t lf_key_dead;
+#define LF_KEY_DEAD     (&lf_key_dead)
+
+//スロット
+typedef struct {
+    _Atomic(lf_key_t*) key;
+    _Atomic uint64_t val;
+} lf_slot_t;
+
+//ロックフリー版のテーブル
+typedef struct lf_table {
+    size_t capacity;                //スロット数（2のべき乗）
+    size_t mask;                    //capacity-1
+    size_t limit;                   //usedがこれ以上になったらリサイズする
+    int shift;                      //hash>>shiftがホームのインデックス（64-log2(capacity)）
+    _Atomic size_t used;            //キーを設定したスロット数（削除済みも含む）
+    _Atomic(struct lf_table*) next; //コピー先のテーブル
+    _Atomic size_t copy_idx;        //次にコピーを担当するチャンクの先頭
+    _Atomic size_t copy_done;       //コピー済みのスロット数
+    uint64_t retire_epoch;          //退避したエポック
+    struct lf_table *retire_next;   //退避リスト
+    lf_slot_t slots[];
+} lf_table_t;
+
+//ロックフリー版のハッシュマップ本体
+typedef struct lf_hash_map {
+    _Atomic(lf_table_t*) table;     //最も古いテーブル（コピー中はnextを辿る）
+    _Atomic size_t num;             //データ数
+    hash_func_t hash_func;          //ハッシュ関数
+    hash64_func_t hash64_func;      //64ビットのハッシュ関数
+    _Atomic(lf_table_t*) retired;   //退避したテーブル（EBRで解放を待つ）
+    pthread_mutex_t reclaim_lock;   //解放処理は1スレッドだけ（trylockで取れなければ後回し）
+} lf_hash_map_t;
+
+//EBRのスレッド毎のレコード
+//スレッド終了時に未使用に戻し、別のスレッドが再利用する（解放はしない）。
+typedef struct ebr_thread {
+    _Atomic uint64_t epoch;         //実行中: (エポック<<1)|1、停止中: 0
+    _Atomic int in_use;             //スレッドが使用中
+    int depth;                      //ebr_enterのネスト
+    struct ebr_thread *next;
+} __attribute__((aligned(64))) ebr_thread_t;
+
+static _Atomic uint64_t ebr_epoch = 1;
+static _Atomic(ebr_thread_t*) ebr_threads;
+static pthread_key_t ebr_key;
+static pthread_once_t ebr_once = PTHREAD_ONCE_INIT;
+static __thread ebr_thread_t *ebr_self;
+
+static void ebr_thread_exit(void *p) {
+    ebr_thread_t *thread = p;
+    atomic_store(&thread->epoch, 0);
+    atomic_store(&thread->in_use, 0);
+}
+
+static void ebr_init(void) {
+    pthread_key_create(&ebr_key, ebr_thread_exit);
+}
+
+//スレッドのレコードを登録する（未使用のレコードがあれば再利用する）
+static ebr_thread_t *ebr_register(void) {
+    pthread_once(&ebr_once, ebr_init);
+    ebr_thread_t *thread;
+    for (thread=atomic_load(&ebr_threads); thread; thread=thread->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&thread->in_use, &expected, 1)) break;
+    }
+    if (!thread) {
+        thread = aligned_alloc(64, sizeof(ebr_thread_t));
+        assert(thread);
+        memset(thread, 0, sizeof(ebr_thread_t));
+        atomic_store(&thread->in_use, 1);
+        thread->next = atomic_load(&ebr_threads);
+        while (!atomic_compare_exchange_weak(&ebr_threads, &thread->next, thread));
+    }
+    thread->depth = 0;
+    pthread_setspecific(ebr_key, thread);
+    return ebr_self = thread;
+}
+
+//クリティカルセクションの開始（この間に読んだテーブルとキーは解放されない）
+static inline void ebr_enter(void) {
+    ebr_thread_t *thread = ebr_self ? ebr_self : ebr_register();
+    if (thread->depth++ == 0) atomic_store(&thread->epoch, (atomic_load(&ebr_epoch) << 1) | 1);
+}
+
+//クリティカルセクションの終了
+static inline void ebr_exit(void) {
+    ebr_thread_t *thread = ebr_self;
+    if (--thread->depth == 0) atomic_store_explicit(&thread->epoch, 0, memory_order_release);
+}
+
+//実行中のスレッドの最小のエポック
+static uint64_t ebr_min_epoch(void) {
+    uint64_t min = UINT64_MAX;
+    for (ebr_thread_t *thread=atomic_load(&ebr_threads); thread; thread=thread->next) {
+        uint64_t epoch = atomic_load(&thread->epoch);
+        if ((epoch & 1) && (epoch >> 1) < min) min = epoch >> 1;
+    }
+    return min;
+}
+
+//キーの64ビットのハッシュ値（hash_keyと同じ）
+static inline uint64_t lf_hash_key(lf_hash_map_t *map, const char *key, int keylen) {
+    if (map->hash64_func) return map->hash64_func(key, keylen);
+    return map->hash_func(key, keylen) * HASH_MUL64;
+}
+
+static inline int lf_key_eq(lf_key_t *k, const char *key, int keylen, uint64_t hash) {
+    return k->hash==hash && k->keylen==keylen && memcmp(k->key, key, keylen)==0;
+}
+
+static lf_key_t *lf_new_key(const char *key, int keylen, uint64_t hash) {
+    lf_key_t *k = malloc(sizeof(lf_key_t) + keylen);
+    assert(k);
+    atomic_init(&k->owner, NULL);
+    k->hash = hash;
+    k->keylen = keylen;
+    memcpy(k->key, key, keylen);
+    return k;
+}
+
+static lf_table_t *lf_new_table(size_t capacity) {
+    lf_table_t *table = calloc(1, sizeof(lf_table_t) + capacity * sizeof(lf_slot_t));
+    assert(table);
+    table->capacity = capacity;
+    table->mask = capacity - 1;
+    table->limit = capacity * LF_MAX_LOAD / 100;
+    table->shift = 64;
+    while (capacity > 1) { capacity >>= 1; table->shift--; }
+    return table;
+}
+
+//テーブルを解放する
+//LF_DROPのスロットのキーと、このテーブルがデータを持つキーも解放する。
+static void lf_free_table(lf_table_t *table) {
+    for (size_t i=0; i<table->capacity; i++) {
+        lf_key_t *k = atomic_load(&table->slots[i].key);
+        uint64_t v = atomic_load(&table->slots[i].val);
+        if (!k || k==LF_KEY_DEAD || v==LF_MOVED || v==LF_DEAD) continue;
+        if (v==LF_DROP || atomic_load(&k->owner)==table) free(k);
+    }
+    free(table);
+}
+
+//退避したテーブルのうち、どのスレッドも参照していないものを解放する
+static void lf_reclaim(lf_hash_map_t *map) {
+    if (pthread_mutex_trylock(&map->reclaim_lock)) return;
+    uint64_t min = ebr_min_epoch();
+    lf_table_t *table = atomic_exchange(&map->retired, NULL);
+    while (table) {
+        lf_table_t *next = table->retire_next;
+        if (table->retire_epoch <= min) {
+            lf_free_table(table);
+        } else {
+            table->retire_next = atomic_load(&map->retired);
+            while (!atomic_compare_exchange_weak(&map->retired, &table->retire_next, table));
+        }
+        table = next;
+    }
+    pthread_mutex_unlock(&map->reclaim_lock);
+}
+
+//map->tableから外したテーブルを退避する
+//エポックを進め、それ以前から実行中のスレッドがいなくなったら解放する。
+static void lf_retire(lf_hash_map_t *map, lf_table_t *table) {
+    table->retire_epoch = atomic_fetch_add(&ebr_epoch, 1) + 1;
+    table->retire_next = atomic_load(&map->retired);
+    while (!atomic_compare_exchange_weak(&map->retired, &table->retire_next, table));
+    lf_reclaim(map);
+}
+
+//コピー先のテーブルを作成する（すでにあればそれを返す）
+//データ数が容量の1/4以上なら倍にし、そうでなければ同じサイズで削除済みキーを捨てる。
+static lf_table_t *lf_resize(lf_hash_map_t *map, lf_table_t *table) {
+    lf_table_t *next = atomic_load(&table->next);
+    if (next) return next;
+    size_t capacity = table->capacity;
+    while (atomic_load(&map->num) * 4 >= capacity) capacity *= 2;
+    next = lf_new_table(capacity);
+    lf_table_t *expected = NULL;
+    if (!atomic_compare_exchange_strong(&table->next, &expected, next)) {
+        free(next);
+        return expected;
+    }
+    return next;
+}
+
+static uint64_t lf_put_table(lf_hash_map_t *map, lf_table_t *table, const char *key, int keylen, uint64_t hash, uint64_t val, lf_key_t *copy_key);
+
+//スロットを新テーブルにコピーする
+//値を凍結し（LF_PRIME）、有効なデータだけ新テーブルに書き込んでからLF_MOVEDにする。
+//複数のスレッドが同じスロットをコピーしても結果は同じ。
+static void lf_copy_slot(lf_hash_map_t *map, lf_table_t *table, size_t idx) {
+    lf_slot_t *slot = &table->slots[idx];
+    lf_key_t *k = NULL;
+    if (atomic_compare_exchange_strong(&slot->key, &k, LF_KEY_DEAD)) return;
+    if (k == LF_KEY_DEAD) return;
+
+    uint64_t v = atomic_load(&slot->val);
+    while (!(v & LF_PRIME)) {
+        if (LF_COPIED(v)) return;
+        uint64_t frozen = LF_PRIME | ((v & LF_LIVE) ? v : LF_TOMB);
+        if (atomic_compare_exchange_weak(&slot->val, &v, frozen)) v = frozen;
+    }
+    uint64_t expected = v;
+    if (v & LF_LIVE) {
+        lf_put_table(map, atomic_load(&table->next), k->key, k->keylen, k->hash, v & ~LF_PRIME, k);
+        atomic_compare_exchange_strong(&slot->val, &expected, LF_MOVED);
+    } else {
+        //このテーブルがキーを所有していれば、テーブルと一緒に解放する
+        atomic_compare_exchange_strong(&slot->val, &expected, atomic_load(&k->owner)==table ? LF_DROP : LF_DEAD);
+    }
+}
+
+//コピーが完了したテーブルをmap->tableから外す
+static void lf_promote(lf_hash_map_t *map) {
+    lf_table_t *table = atomic_load(&map->table);
+    lf_table_t *next;
+    while ((next = atomic_load(&table->next)) && atomic_load(&table->copy_done) == table->capacity) {
+        if (atomic_compare_exchange_strong(&map->table, &table, next)) {
+            lf_retire(map, table);
+            table = next;
+        }
+    }
+}
+
+//協調コピー：チャンクを1つ担当してコピーする
+static void lf_help_copy(lf_hash_map_t *map, lf_table_t *table) {
+    size_t begin = atomic_fetch_add(&table->copy_idx, LF_COPY_CHUNK);
+    if (begin >= table->capacity) return;
+    size_t end = begin + LF_COPY_CHUNK < table->capacity ? begin + LF_COPY_CHUNK : table->capacity;
+    for (size_t i=begin; i<end; i++) lf_copy_slot(map, table, i);
+    if (atomic_fetch_add(&table->copy_done, end - begin) + (end - begin) == table->capacity) lf_promote(map);
+}
+
+//スロットの値を更新する
+//更新した場合は1を返し、oldに以前の値を設定する。スロットがコピー中の場合は0を返す（新テーブルで更新する）。
+//copy_keyを指定した場合（コピー時）は値が未設定の場合だけ書き込む。
+static int lf_put_slot(lf_hash_map_t *map, lf_table_t *table, size_t idx, uint64_t val, lf_key_t *copy_key, uint64_t *old) {
+    lf_slot_t *slot = &table->slots[idx];
+    if (!copy_key && atomic_load(&table->next)) {
+        lf_copy_slot(map, table, idx);
+        return 0;
+    }
+    uint64_t v = atomic_load(&slot->val);
+    for (;;) {
+        if (LF_COPIED(v)) return 0;
+        if (v & LF_PRIME) {
+            lf_copy_slot(map, table, idx);
+            return 0;
+        }
+        if ((copy_key && v) || (val==LF_TOMB && !(v & LF_LIVE))) {
+            *old = v;
+            return 1;
+        }
+        if (atomic_compare_exchange_weak(&slot->val, &v, val)) {
+            if (copy_key) atomic_store(&copy_key->owner, table);
+            *old = v;
+            return 1;
+        }
+    }
+}
+
+//テーブルにデータを書き込む（val==LF_TOMBの場合は削除）
+//以前の値を返す。コピー中のスロットや探索上限を超えた場合は新テーブルに書き込む。
+static uint64_t lf_put_table(lf_hash_map_t *map, lf_table_t *table, const char *key, int keylen, uint64_t hash, uint64_t val, lf_key_t *copy_key) {
+    lf_key_t *rec = NULL;       //新規キー用に確保したレコード（未公開）
+    for (;;) {
+        lf_table_t *next = atomic_load(&table->next);
+        if (!next && atomic_load_explicit(&table->used, memory_order_relaxed) >= table->limit) next = lf_resize(map, table);
+        size_t idx = hash >> table->shift;
+        size_t limit = LF_REPROBE_LIMIT(table->capacity);
+        for (size_t n=0; n<limit; n++, idx=(idx+1)&table->mask) {
+            lf_slot_t *slot = &table->slots[idx];
+            lf_key_t *k = atomic_load_explicit(&slot->key, memory_order_acquire);
+            if (!k) {
+                if (val == LF_TOMB) return 0;
+                if (next) {
+                    lf_copy_slot(map, table, idx);
+                    k = atomic_load(&slot->key);
+                } else {
+                    lf_key_t *new_key = copy_key;
+                    if (!new_key) {
+                        if (!rec) rec = lf_new_key(key, keylen, hash);
+                        atomic_store_explicit(&rec->owner, table, memory_order_relaxed);
+                        new_key = rec;
+                    }
+                    if (atomic_compare_exchange_strong(&slot->key, &k, new_key)) {
+                        atomic_fetch_add_explicit(&table->used, 1, memory_order_relaxed);
+                        if (new_key == rec) rec = NULL;
+                        k = new_key;
+                    }
+                }
+            }
+            if (k == LF_KEY_DEAD) break;
+            if (k != copy_key && !lf_key_eq(k, key, keylen, hash)) continue;
+            uint64_t old;
+            if (lf_put_slot(map, table, idx, val, copy_key, &old)) {
+                free(rec);
+                return old;
+            }
+            break;
+        }
+        table = next ? next : lf_resize(map, table);
+    }
+}
+
+//テーブルからデータを取得する
+//値（0: なし、LF_TOMB: 削除済み、LF_LIVE|data）を返す。テーブルには書き込まない。
+static uint64_t lf_get_table(lf_table_t *table, const char *key, int keylen, uint64_t hash) {
+    for (;;) {
+        size_t idx = hash >> table->shift;
+        size_t limit = LF_REPROBE_LIMIT(table->capacity);
+        for (size_t n=0; n<limit; n++, idx=(idx+1)&table->mask) {
+            lf_slot_t *slot = &table->slots[idx];
+            lf_key_t *k = atomic_load_explicit(&slot->key, memory_order_acquire);
+            if (!k) return 0;
+            if (k == LF_KEY_DEAD) break;
+            if (!lf_key_eq(k, key, keylen, hash)) continue;
+            uint64_t v = atomic_load_explicit(&slot->val, memory_order_acquire);
+            if (LF_COPIED(v)) break;
+            if (v & LF_PRIME) {
+                //新テーブルにまだ書き込まれていなければ凍結した値が最新
+                uint64_t nv = lf_get_table(atomic_load_explicit(&table->next, memory_order_acquire), key, keylen, hash);
+                return nv ? nv : v & ~LF_PRIME;
+            }
+            return v;
+        }
+        table = atomic_load_explicit(&table->next, memory_order_acquire);
+        if (!table) return 0;
+    }
+}
+
+//ロックフリーのハッシュマップを作成する。
+lf_hash_map_t *new_lf_hash_map(const hash_map_config_t *config) {
+    assert(config);
+    lf_hash_map_t *map = calloc(1, sizeof(lf_hash_map_t));
+    assert(map);
+    size_t capacity = HASH_MAP_INIT_SIZE;
+    while (capacity * LF_MAX_LOAD / 100 < config->init_size) capacity *= 2;
+    atomic_init(&map->table, lf_new_table(capacity));
+    map->hash_func = config->hash_func?config->hash_func:fnv1a_hash;
+    map->hash64_func = config->hash64_func;
+    pthread_mutex_init(&map->reclaim_lock, NULL);
+    return map;
+}
+
+//ロックフリーのハッシュマップをフリーする。
+//他のスレッドが操作していないときに呼ぶ。
+void free_lf_hash_map(lf_hash_map_t *map) {
+    if (map) {
+        lf_table_t *table;
+        while (atomic_load(&(table = atomic_load(&map->table))->next)) lf_help_copy(map, table);
+        for (lf_table_t *t=atomic_load(&map->retired), *next; t; t=next) {
+            next = t->retire_next;
+            lf_free_table(t);
+        }
+        lf_free_table(table);
+        pthread_mutex_destroy(&map->reclaim_lock);
+    }
+    free(map);
+}
+
+//データ書き込み（put_hash_mapと同じ）
+//dataの上位2ビットは内部で使用するので0でなければならない。
+int put_lf_hash_map(lf_hash_map_t *map, const char *key, int keylen, void *data) {
+    assert(map);
+    assert(key);
+    assert(((uintptr_t)data & ~LF_DATA_MASK) == 0);
+    uint64_t hash = lf_hash_key(map, key, keylen);
+    ebr_enter();
+    lf_table_t *table = atomic_load(&map->table);
+    if (atomic_load(&table->next)) lf_help_copy(map, table);
+    uint64_t old = lf_put_table(map, table, key, keylen, hash, LF_LIVE | (uintptr_t)data, NULL);
+    ebr_exit();
+    if (old & LF_LIVE) return 0;
+    atomic_fetch_add(&map->num, 1);
+    return 1;
+}
+
+//キーに対応するデータの取得（get_hash_mapと同じ）
+//ロックを取らず、テーブルにも書き込まない。
+int get_lf_hash_map(lf_hash_map_t *map, const char *key, int keylen, void **data) {
+    assert(map);
+    assert(key);
+    uint64_t hash = lf_hash_key(map, key, keylen);
+    ebr_enter();
+    uint64_t v = lf_get_table(atomic_load(&map->table), key, keylen, hash);
+    ebr_exit();
+    if (!(v & LF_LIVE)) return 0;
+    if (data) *data = (void*)(uintptr_t)(v & LF_DATA_MASK);
+    return 1;
+}
+
+//データの削除（del_hash_mapと同じ）
+int del_lf_hash_map(lf_hash_map_t *map, const char *key, int keylen) {
+    assert(map);
+    assert(key);
+    uint64_t hash = lf_hash_key(map, key, keylen);
+    ebr_enter();
+    lf_table_t *table = atomic_load(&map->table);
+    if (atomic_load(&table->next)) lf_help_copy(map, table);
+    uint64_t old = lf_put_table(map, table, key, keylen, hash, LF_TOMB, NULL);
+    ebr_exit();
+    if (!(old & LF_LIVE)) return 0;
+    atomic_fetch_sub(&map->num, 1);
+    return 1;
+}
+
+//ハッシュマップのデータ数
+size_t num_lf_hash_map(lf_hash_map_t *map) {
+    return atomic_load(&map->num);
+}
+
 //ハッシュマップをダンプする
 //level=0: 基本情報のみ
 //level=1: 有効なキーすべて
-//level=2: 削除済みも含める
+//level=2: level=1と同じ（削除済みエントリは残らない）
 void dump_hash_map(const char *str, hash_map_t *hash_map, int level) {
-    int n_col = 0;
+    hash_map_stats_t stats;
+    stats_hash_map(hash_map, &stats);
+    hash_map_probe_stats_t probe;
+    probe_stats_hash_map(hash_map, &probe);
     long long len = 0;
-    for (int i=0; i<hash_map->capacity; i++) {
-        hash_entry_t *entry = &hash_map->buckets[i];
-        if (entry->key && entry->key!=TOMBSTONE) {
-            int idx = hash_map->hash_func(entry->key, entry->keylen) % hash_map->capacity;
-            if (idx != i) n_col++;
-            len += entry->keylen;
+    hash_table_t *tables[] = {&hash_map->table, &hash_map->old};
+    for (int t=0; t<2; t++) {
+        hash_table_t *table = tables[t];
+        for (size_t i=0; i<table->capacity; i++) {
+            if (IS_FULL(table->ctrl[i])) len += table->buckets[i].keylen;
         }
     }
-    fprintf(stderr, "= %s: num=%d,\tused=%d,\tcapacity=%d(%.1f%%),\tcollision=%.1f%%\tkey_len=%lld\n", 
-        str, hash_map->num, hash_map->used, hash_map->capacity, hash_map->num*100.0/hash_map->capacity,
-        n_col*100.0/hash_map->capacity, len/hash_map->num);
+    size_t n_col = stats.num - probe.probe_hist[0];     //ホーム以外にあるエントリ
+    fprintf(stderr, "= %s: num=%zu,\tcapacity=%zu(%.1f%%),\tcollision=%.1f%%\tprobe=%.2f(max %d)\tkey_len=%lld\talloc=%ld\trehash=%ld(%.3fs)\n",
+        str, stats.num, stats.capacity, stats.load_factor*100.0,
+        n_col*100.0/stats.capacity, probe.avg_probe, probe.max_probe, stats.num ? len/(long long)stats.num : 0,
+        stats.n_alloc, stats.rehash_count, stats.rehash_sec);
+    if (hash_map->old.buckets) {
+        fprintf(stderr, "= %s: rehashing: old capacity=%zu, left=%zu\n", str, hash_map->old.capacity, hash_map->migrate_left);
+    }
     if (level>0) {
-        for (int i=0; i<hash_map->capacity; i++) {
-            hash_entry_t *entry = &hash_map->buckets[i];
-            if (!entry->key) continue;
-            if (entry->key!=TOMBSTONE) {
-                fprintf(stderr, "%02d: \"", i);
-                fprint_key(stderr, entry->key, entry->keylen);
+        for (int t=0; t<2; t++) {
+            hash_table_t *table = tables[t];
+            for (size_t i=0; i<table->capacity; i++) {
+                hash_entry_t *entry = &table->buckets[i];
+                if (table->ctrl[i]==CTRL_EMPTY) continue;
+                fprintf(stderr, "%s%02zu: \"", t?"old ":"", i);
+                fprint_key(stderr, (unsigned char*)entry_key(table, entry), entry->keylen);
                 fprintf(stderr, "\", %p\n", entry->data);
-            } else if (level>1) {
-                fprintf(stderr, "%02d: \"TOMBSTONE\", %p\n", i, entry->data);
             }
         }
     }
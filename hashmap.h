@@ -2,10 +2,25 @@
 //
 //## 機能
 //- キー：バイト列、データ：任意のポインタ
-//- 追加・削除・検索・イテレート
-//- 1エントリ当たり1回のmalloc（キーの保存）
+//- 追加・削除・検索・イテレート（スタック上のイテレータ、範囲に分割した並列イテレート）
+//- upsert（1回の探索で検索と追加を行い、データの格納場所を返す）
+//- エントリ毎のmallocなし（16バイト以下のキーはエントリ内、長いキーはアリーナに保存）
+//- 1バイトの制御バイト配列を16個ずつ（SSE2）検索し、タグが一致したエントリだけキーを比較する
+//- Robin Hood法で挿入し、削除は後方シフトで詰める（TOMBSTONEなし）
+//- スレッドセーフなシャーディング版（シャード毎の読み書きロック）
+//- キーの配列からの並列一括構築
+//- 複数のハッシュマップの並列マージ（キーはコピーせずに移し、同じキーのデータは関数で結合する）
+//- スナップショットの保存と、mmapによる読み込み（読み込み専用）
+//- ロックフリー版（CASによる挿入、論理削除、協調リサイズ、EBRによるメモリ回収）
+//- 統計情報（探索距離のヒストグラム、リハッシュの回数と時間など）
+//- データ数に上限のあるキャッシュ（CLOCKで追い出す）
+//- メモリ確保の関数の指定、バケット配列のヒュージページ
+//- 整数キーの型別ハッシュマップ（hashmap_int.h、マクロで生成、キーと値をバケットに直接保存）
 //- ハッシュ関数は[FNV-1a、FNV-1](http://www.isthe.com/chongo/tech/comp/fnv/index.html)、
-//  [CRC32]((https://ja.wikipedia.org/wiki/%E5%B7%A1%E5%9B%9E%E5%86%97%E9%95%B7%E6%A4%9C%E6%9F%BB#CRC-32))
+//  [CRC32]((https://ja.wikipedia.org/wiki/%E5%B7%A1%E5%9B%9E%E5%86%97%E9%95%B7%E6%A4%9C%E6%9F%BB#CRC-32))、
+//  CRC32C（SSE4.2があればハードウェアで計算）、
+//  [wyhash](https://github.com/wangyi-fudan/wyhash)（64ビット）
+//- バケット数は2のべき乗で、インデックスはハッシュ値をマップ毎のソルトと混ぜた上位ビット（シフト）で求める（サイズはsize_tで、2^39バケットまで）
 //
 //## 参考
 //- https://jonosuke.hatenadiary.org/entry/20100406/p1
@@ -17,18 +32,74 @@
 uint32_t fnv1a_hash(const char *s, int len);    //FNV-1a hash (Default)
 uint32_t fnv1_hash (const char *s, int len);    //FNV-1 hash
 uint32_t crc32_hash(const char *s, int len);    //CRC32 hash
+uint32_t crc32c_hash(const char *s, int len);   //CRC32C hash (Castagnoli)
+uint64_t wy_hash   (const char *s, int len);    //wyhash (64ビット)
 
 //ハッシュ関数
 typedef uint32_t(*hash_func_t)(const char *s, int len);
 
+//64ビットのハッシュ関数
+//データ数が2^32に近づく場合は32ビットのハッシュ関数では区別できないので、こちらを指定する。
+typedef uint64_t(*hash64_func_t)(const char *s, int len);
+
 //ハッシュマップ
 typedef struct hash_map hash_map_t;
 
 //ハッシュマップを作成する。
-//init_sizeが0の場合はデフォルト値(16)を用いる。
+//init_sizeが0の場合はデフォルト値(16)を用いる。init_size以上の2のべき乗に切り上げる。
 //hash_funcがNULLの場合はfnv1a_hashを用いる。
 hash_map_t *new_hash_map(size_t init_size, hash_func_t hash_func);
 
+//HASH_MAP_CACHEで追い出したデータを通知する関数
+//keyは呼び出し中だけ有効。この関数の中でハッシュマップを操作してはならない。
+typedef void (*hash_map_evict_t)(const char *key, int keylen, void *data, void *arg);
+
+//メモリ確保の関数（jemallocのアリーナやNUMAノード毎のアロケータなどを使う場合）
+//allocはsizeバイトを確保して返す（失敗した場合はNULL）。freeには確保したときのsizeを渡す。
+//バケット配列、長いキーのアリーナのチャンク、ハッシュマップ本体の確保に使う。
+typedef struct {
+    void *(*alloc)(size_t size, void *arg);
+    void (*free)(void *ptr, size_t size, void *arg);
+    void *arg;              //alloc/freeに渡す引数
+} hash_map_allocator_t;
+
+//ハッシュマップの設定
+typedef struct {
+    size_t init_size;       //初期サイズ（0の場合はデフォルト値(16)）
+    hash_func_t hash_func;  //ハッシュ関数（NULLの場合はfnv1a_hash）
+    int flags;              //以下のフラグの組み合わせ
+    hash64_func_t hash64_func;  //64ビットのハッシュ関数（指定した場合はhash_funcより優先）
+    size_t max_num;             //HASH_MAP_CACHEのデータ数の上限
+    hash_map_evict_t evict_func;    //HASH_MAP_CACHEで追い出したデータを通知する関数（NULL可）
+    void *evict_arg;            //evict_funcに渡す引数
+    hash_map_allocator_t allocator; //メモリ確保の関数（allocがNULLの場合はmalloc/free）
+} hash_map_config_t;
+
+//リハッシュを一度に行わず、以後のput/get/del毎に少しずつバケットを移動する。
+//リハッシュ中は新旧のバケット配列が共存する。getもバケットを移動するのでハッシュマップを変更する。
+//削除によるキーのコンパクションも、同じサイズのバケット配列への移動と一緒に少しずつ行う。
+#define HASH_MAP_INCREMENTAL    0x01
+
+//データ数をmax_numまでに制限するキャッシュ。
+//データ数が上限のときに新しいキーをputすると、CLOCK（近似LRU）で選んだエントリを追い出してevict_funcに通知する。
+//バケット配列は最初に上限分を確保してリハッシュせず、参照ビットはバケット毎に1バイトをまとめて確保する。
+//get/put/upsert/find_slotで参照ビットを立てる（getもハッシュマップを変更する）。
+//reserve_hash_mapは何もせず、shrink_hash_mapはキーのコンパクションだけを行う。
+//シャーディング版、一括構築では使えない。
+#define HASH_MAP_CACHE          0x02
+
+//2MB以上のバケット配列をヒュージページで確保する（TLBミスを減らす）。
+//予約済みのヒュージページ（MAP_HUGETLB）がなければmmapしてmadvise(MADV_HUGEPAGE)し、
+//mmapに失敗した場合は通常のメモリ確保を使う。
+#define HASH_MAP_HUGE_PAGES     0x04
+
+//load_hash_mapでバケット毎に制御バイトとキー・データのオフセットを確認する（O(バケット数)）。
+//指定しなければヘッダだけを確認するので、ファイルは信頼できるものでなければならない。
+#define HASH_MAP_VERIFY         0x08
+
+//設定を指定してハッシュマップを作成する。
+hash_map_t *new_hash_map_config(const hash_map_config_t *config);
+
 //ハッシュマップをフリーする。
 void free_hash_map(hash_map_t *hash_map);
 
@@ -42,30 +113,194 @@ int put_hash_map(hash_map_t *hash_map, const char *key, int keylen, void *data);
 //存在しなければ0を返す。
 int get_hash_map(hash_map_t *hash_map, const char *key, int keylen, void **data);
 
+//キーのデータの格納場所（dataへのポインタ）を返す。
+//キーが存在しなければデータNULLで追加して*insertedに1を、存在すれば0を設定する。insertedにNULLを指定できる。
+//get_hash_mapとput_hash_mapを続けて呼ぶのと違い、ハッシュ値の計算と探索は1回だけで、既存のキーはコピーしない。
+//返すポインタはハッシュマップを次に操作するまで有効。
+void **upsert_hash_map(hash_map_t *hash_map, const char *key, int keylen, int *inserted);
+
+//キーのデータの格納場所を返す。存在しなければNULLを返す（追加もメモリ確保もしない）。
+//返すポインタはハッシュマップを次に操作するまで有効。
+void **find_slot_hash_map(hash_map_t *hash_map, const char *key, int keylen);
+
 //データの削除
 //キーに対応するデータを削除して1を返す。
 //データが存在しない場合は0を返す。
 int del_hash_map(hash_map_t *hash_map, const char *key, int keylen);
 
+//複数のキーのデータをまとめて取得する
+//keys[i],keylens[i]に対応するデータをdata[i]に設定する（存在しなければNULL）。
+//found[i]には存在すれば1、存在しなければ0を設定する。data,foundにNULLを指定できる。
+//存在したキーの数を返す。
+//ハッシュ値を先に計算してバケットとキーをプリフェッチするので、大きなハッシュマップでは
+//get_hash_mapを繰り返すより速い。
+size_t get_hash_map_batch(hash_map_t *hash_map, const char *const *keys, const int *keylens, size_t n, void **data, int *found);
+
+//複数のキーのデータをまとめて書き込む
+//keys[i]の順にput_hash_mapしたのと同じ結果になる。dataにNULLを指定するとすべてNULLを書き込む。
+//新規データの数を返す。
+size_t put_hash_map_batch(hash_map_t *hash_map, const char *const *keys, const int *keylens, void *const *data, size_t n);
+
+//キーの配列からハッシュマップを一括で作成する。
+//データ数に合わせてバケット配列を一度だけ確保し、n_threadスレッドで並列に挿入する（0の場合はCPU数）。
+//dataにNULLを指定できる。同じキーが複数ある場合は後のデータになる（putを順に呼んだのと同じ）。
+hash_map_t *build_hash_map(const hash_map_config_t *config, const char *const *keys, const int *keylens, void *const *data, size_t n, int n_thread);
+
+//マージで同じキーがあった場合にデータを結合する関数
+//dataはマージ先（またはそれまでに結合した）データ、src_dataはマージ元のデータ。戻り値をマージ先のデータにする。
+typedef void *(*hash_map_combine_t)(void *data, void *src_data, void *arg);
+
+//n個のハッシュマップsrcsをdstにマージする。
+//dstのバケット配列を一度だけ確保し直し、n_threadスレッドで並列に挿入する（0の場合はCPU数）。
+//キーはコピーせずにマージ元から移すので、マージ元は空になる（そのまま使い続けることも解放することもできる）。
+//同じキーはdst、srcs[0]、srcs[1]、...の順にcombineで結合する（NULLの場合は後のデータ）。
+//combineは別々のキーについて複数のスレッドから同時に呼ばれる。
+//すべてのハッシュマップのハッシュ関数とアロケータが同じであること（HASH_MAP_CACHE、スナップショットは不可）。
+void merge_hash_map(hash_map_t *dst, hash_map_t *const *srcs, int n, hash_map_combine_t combine, void *arg, int n_thread);
+
 //ハッシュマップのデータ数
-int num_hash_map(hash_map_t *hash_map);
+size_t num_hash_map(hash_map_t *hash_map);
+
+//データ数nまでリハッシュしないようにバケット配列を拡張する。
+void reserve_hash_map(hash_map_t *hash_map, size_t n);
+
+//データ数に合わせてバケット配列を縮小し、キーのメモリをコンパクションする。
+void shrink_hash_map(hash_map_t *hash_map);
+
+//削除したキーのメモリを回収する（バケット配列のサイズは変えない）。
+void compact_hash_map(hash_map_t *hash_map);
+
+//ハッシュマップがこれまでに行ったメモリ確保の回数
+long alloc_count_hash_map(hash_map_t *hash_map);
+
+#define HASH_MAP_PROBE_HIST 32  //探索距離のヒストグラムのサイズ（最後の要素はそれ以上の距離）
+
+//ハッシュマップの統計情報
+typedef struct {
+    size_t num;             //データ数
+    size_t capacity;        //バケット数
+    double load_factor;     //使用率（num/capacity）
+    long rehash_count;      //リハッシュの回数
+    double rehash_sec;      //リハッシュにかかった時間の累計（インクリメンタルリハッシュの移動を含む）
+    int rehashing;          //リハッシュ中であれば1
+    size_t old_capacity;    //リハッシュ中の旧バケット数
+    size_t migrate_left;    //リハッシュ中の旧バケット配列の未処理のバケット数
+    size_t key_bytes;       //アリーナ内の有効なキーのバイト数
+    size_t dead_key_bytes;  //アリーナ内の削除済みキーのバイト数
+    long n_alloc;           //メモリ確保の回数
+    long evictions;         //HASH_MAP_CACHEで追い出した回数
+    int huge_pages;         //バケット配列をヒュージページで確保した場合は1
+    //以下はHASH_MAP_OP_STATSを定義してビルドした場合のみ（put/get/del_hash_map、バッチ版、upsert/find_slotを数える）
+    int op_stats;           //操作の回数を数えている場合は1
+    long hits;              //get/find_slotで見つかった回数（upsertで既存だった回数を含む）
+    long misses;            //get/find_slotで見つからなかった回数
+    long inserts;           //put/upsertで追加した回数
+    long overwrites;        //putで上書きした回数
+    long deletes;           //delで削除した回数
+} hash_map_stats_t;
+
+//ハッシュマップの統計情報をstatsに設定する。
+//ハッシュマップが保持しているカウンタを写すだけなので、バケット配列は走査しない（O(1)）。
+void stats_hash_map(hash_map_t *hash_map, hash_map_stats_t *stats);
+
+//探索距離の統計情報
+typedef struct {
+    size_t probe_hist[HASH_MAP_PROBE_HIST]; //ホームからの距離毎のエントリ数
+    int max_probe;          //ホームからの距離の最大値
+    double avg_probe;       //ホームからの距離の平均値
+} hash_map_probe_stats_t;
+
+//探索距離のヒストグラムをprobeに設定する。
+//キーは読まず、制御バイトとエントリのハッシュ値だけを走査する（O(capacity)）。ハッシュマップは変更しない。
+void probe_stats_hash_map(hash_map_t *hash_map, hash_map_probe_stats_t *probe);
 
 //イテレータ
-typedef struct iterator iterator_t;
+//スタック上に確保してinit_iterateまたはsplit_iterate_hash_mapで初期化できる（フィールドは内部用）。
+typedef struct iterator {
+    hash_map_t  *hash_map;
+    size_t      next_idx;   //次に調べるバケット
+    size_t      end_idx;    //範囲の終わり（このバケットは含まない）
+} iterator_t;
 
 //ハッシュマップのイテレータを生成する。
+//リハッシュ中であれば先に完了させる。
 iterator_t *iterate_hash_map(hash_map_t *hash_map);
 
+//イテレータを初期化する（iterate_hash_mapと同じだがメモリを確保しない。end_iterateは不要）。
+void init_iterate(iterator_t *iterator, hash_map_t *hash_map);
+
+//バケット配列を重ならないn個の範囲に分割し、iterators[0..n-1]をそれぞれの範囲のイテレータに初期化する。
+//ハッシュマップを変更しなければ、各イテレータを別々のスレッドで並行してイテレートできる。
+//リハッシュ中であれば先に完了させる。end_iterateは不要。
+void split_iterate_hash_map(hash_map_t *hash_map, iterator_t *iterators, int n);
+
 //次のデータをkey,keylen,dataに設定して1を返す。key,keylen,dataにNULL指定可能。
 //次のデータがない場合は0を返す。
 //イテレートする順番はランダム。
+//keyはハッシュマップを変更するまで有効。
 int next_iterate(iterator_t* iterator, char **key, int *keylen, void **data);
 
-//ハッシュマップのイテレータを解放する。
+//iterate_hash_mapで生成したイテレータを解放する。
 void end_iterate(iterator_t* iterator);
 
+//データをシリアライズする関数
+//dataのバイト列を返し、*sizeにそのサイズを設定する。返す領域は次の呼び出しまで有効であればよい。
+typedef const void *(*hash_map_save_data_t)(void *data, size_t *size, void *arg);
+
+//ハッシュマップをファイル（スナップショット）に保存する。成功すれば0、失敗すれば-1を返す。
+//save_dataがNULLの場合はdataの値をそのまま保存する（ポインタでない値の場合）。
+//リハッシュ中であれば先に完了させる。
+int save_hash_map(hash_map_t *hash_map, const char *path, hash_map_save_data_t save_data, void *arg);
+
+//保存したファイルをmmapしてハッシュマップを作成する。失敗すればNULLを返す。
+//エントリ毎のメモリ確保やリハッシュをせず、get/iterateはマップした領域を直接参照する。
+//configのハッシュ関数は保存時と同じでなければならない。読み込み専用でput/delはできない。
+//データをシリアライズした場合、dataにはマップした領域内のバイト列へのポインタを返す。
+//確認するのはヘッダだけなので、壊れたファイルや信頼できないファイルはHASH_MAP_VERIFYを指定する
+//（全バケットを読むので読み込みはO(バケット数)になり、壊れていればNULLを返す）。
+//データの長さは保存しないので、シリアライズしたデータの中身の確認は呼び出し側で行う。
+hash_map_t *load_hash_map(const char *path, const hash_map_config_t *config);
+
+//シャーディングしたハッシュマップ（スレッドセーフ）
+//キーのハッシュ値でシャードを選び、シャード毎の読み書きロックで排他する。
+//検索は読み込みロックなので並行して実行できる。リハッシュはシャード毎に行う。
+typedef struct shard_hash_map shard_hash_map_t;
+
+//シャーディングしたハッシュマップを作成する。
+//n_shardは2のべき乗に切り上げる（最大512）。config->init_sizeは全シャードの合計。
+shard_hash_map_t *new_shard_hash_map(int n_shard, const hash_map_config_t *config);
+
+//シャーディングしたハッシュマップをフリーする。
+void free_shard_hash_map(shard_hash_map_t *shard_map);
+
+//データ書き込み・取得・削除、データ数（put/get/del/num_hash_mapと同じ）
+int put_shard_hash_map(shard_hash_map_t *shard_map, const char *key, int keylen, void *data);
+int get_shard_hash_map(shard_hash_map_t *shard_map, const char *key, int keylen, void **data);
+int del_shard_hash_map(shard_hash_map_t *shard_map, const char *key, int keylen);
+size_t num_shard_hash_map(shard_hash_map_t *shard_map);
+
+//ロックフリーのハッシュマップ
+//getはロックを取らず、テーブルにも書き込まない。putはCASでスロットを確保し、delは論理削除する。
+//リサイズは新しいテーブルを作成し、putするスレッドが協調してコピーする。
+//旧テーブルと不要になったキーはエポックベースの回収（EBR）で解放する。
+typedef struct lf_hash_map lf_hash_map_t;
+
+//ロックフリーのハッシュマップを作成する。
+//config->flags、config->allocatorは使用しない。
+lf_hash_map_t *new_lf_hash_map(const hash_map_config_t *config);
+
+//ロックフリーのハッシュマップをフリーする。他のスレッドが操作していないときに呼ぶ。
+void free_lf_hash_map(lf_hash_map_t *map);
+
+//データ書き込み・取得・削除、データ数（put/get/del/num_hash_mapと同じ）
+//dataの上位2ビットは内部で使用するので0でなければならない（ユーザー空間のポインタは可）。
+int put_lf_hash_map(lf_hash_map_t *map, const char *key, int keylen, void *data);
+int get_lf_hash_map(lf_hash_map_t *map, const char *key, int keylen, void **data);
+int del_lf_hash_map(lf_hash_map_t *map, const char *key, int keylen);
+size_t num_lf_hash_map(lf_hash_map_t *map);
+
 //ハッシュマップをダンプする
 //level=0: 基本情報のみ
 //level=1: 有効なキーすべて
-//level=2: 削除済みも含める
+//level=2: level=1と同じ（削除済みエントリは残らない）
 void dump_hash_map(const char *str, hash_map_t *hash_map, int level);
@@ -0,0 +1,231 @@
+//整数キーのハッシュマップ（マクロで型毎に生成する）
+//
+//キーと値を固定サイズの型で持ち、バケット配列に直接保存する（キーのコピーやメモリ確保なし）。
+//ハッシュ関数は整数のミキサー、キーの比較は==なので、キーの型は整数（スカラー型）に限る。
+//hash_map_tと同じくRobin Hood法で挿入し、削除は後方シフトで詰める（TOMBSTONEなし）。
+//バケット毎にホームからの距離+1を1バイトの配列に持ち（0は未使用）、
+//検索は距離が自分より短いバケットに達した時点で打ち切る。
+//
+//使い方:
+//  HASH_MAP_INIT_INT64(u64, void*)         //uint64_tのキー、void*の値
+//  u64_hash_map_t *map = new_u64_hash_map(0);
+//  put_u64_hash_map(map, 123, p);
+//  void *v;
+//  if (get_u64_hash_map(map, 123, &v)) ...
+//  size_t pos = 0;
+//  uint64_t key;
+//  while (next_u64_hash_map(map, &pos, &key, &v)) ...
+//  free_u64_hash_map(map);
+//
+//生成する関数（nameはHASH_MAP_INIT_*の第1引数）:
+//  name_hash_map_t *new_name_hash_map(size_t init_size);
+//  void free_name_hash_map(name_hash_map_t *map);
+//  int put_name_hash_map(name_hash_map_t *map, key_t key, val_t val);     //新規は1、上書きは0
+//  int get_name_hash_map(name_hash_map_t *map, key_t key, val_t *val);    //valにNULL指定可能
+//  int del_name_hash_map(name_hash_map_t *map, key_t key);
+//  size_t num_name_hash_map(name_hash_map_t *map);
+//  void reserve_name_hash_map(name_hash_map_t *map, size_t n);
+//  int next_name_hash_map(name_hash_map_t *map, size_t *pos, key_t *key, val_t *val);  //*posは0から始める
+#ifndef HASHMAP_INT_H
+#define HASHMAP_INT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#define HASH_INT_INIT_SIZE      16  //ハッシュテーブルの初期サイズ（2のべき乗）
+#define HASH_INT_MAX_CAPACITY   80  //使用率をこれ以下に抑える
+#define HASH_INT_MAX_DIST       255 //ホームからの距離+1の最大値（超える場合はリハッシュする）
+
+//整数のハッシュ関数（MurmurHash3のfmix64）
+//ホームのインデックスは上位ビットで求めるので、下位ビットだけが異なる連番のキーも散らばる。
+static inline uint64_t int64_hash(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+static inline uint64_t int32_hash(uint32_t x) {
+    return int64_hash(x);
+}
+
+//キーの型key_t、値の型val_t、ハッシュ関数hash_func（key_tを受け取りuint64_tを返す）のハッシュマップを生成する
+#define HASH_MAP_INIT_INT_TYPE(name, key_t, val_t, hash_func)                                       \
+                                                                                                    \
+typedef struct {                                                                                    \
+    key_t key;                                                                                      \
+    val_t val;                                                                                      \
+} name##_hash_entry_t;                                                                              \
+                                                                                                    \
+typedef struct {                                                                                    \
+    size_t num;                 /*データ数*/                                                         \
+    size_t limit;               /*データ数の上限（num>=limitで追加するとリハッシュする）*/              \
+    size_t capacity;            /*バケット数（2のべき乗）*/                                           \
+    size_t mask;                /*capacity-1*/                                                      \
+    int shift;                  /*hash>>shiftがホームのインデックス（64-log2(capacity)）*/            \
+    uint8_t *dist;              /*ホームからの距離+1（0は未使用）*/                                   \
+    name##_hash_entry_t *buckets;   /*バケット配列*/                                                 \
+} name##_hash_map_t;                                                                                \
+                                                                                                    \
+static inline void name##_alloc_hash_map(name##_hash_map_t *map, size_t capacity) {                 \
+    int bits = 0;                                                                                   \
+    while (((size_t)1 << bits) < capacity) bits++;                                                  \
+    map->capacity = (size_t)1 << bits;                                                              \
+    map->mask = map->capacity - 1;                                                                  \
+    map->shift = 64 - bits;                                                                         \
+    map->limit = map->capacity * HASH_INT_MAX_CAPACITY / 100;                                       \
+    map->dist = calloc(map->capacity, 1);                                                           \
+    map->buckets = malloc(map->capacity * sizeof(name##_hash_entry_t));                             \
+    assert(map->dist && map->buckets);                                                              \
+}                                                                                                   \
+                                                                                                    \
+static inline name##_hash_map_t *new_##name##_hash_map(size_t init_size) {                          \
+    name##_hash_map_t *map = calloc(1, sizeof(name##_hash_map_t));                                  \
+    assert(map);                                                                                    \
+    name##_alloc_hash_map(map, init_size > HASH_INT_INIT_SIZE ? init_size : HASH_INT_INIT_SIZE);    \
+    return map;                                                                                     \
+}                                                                                                   \
+                                                                                                    \
+static inline void free_##name##_hash_map(name##_hash_map_t *map) {                                 \
+    free(map->dist);                                                                                \
+    free(map->buckets);                                                                             \
+    free(map);                                                                                      \
+}                                                                                                   \
+                                                                                                    \
+static inline void name##_rehash_hash_map(name##_hash_map_t *map, size_t capacity);                 \
+                                                                                                    \
+/*エントリをidx（ホームからの距離d-1）から挿入する（Robin Hood）*/                                     \
+/*距離が上限に達した場合は、手元のエントリまで配置済みなのでリハッシュしてから挿入し直す*/                \
+static inline void name##_insert_hash_map(name##_hash_map_t *map, size_t idx, int d, name##_hash_entry_t entry) { \
+    for (;;) {                                                                                      \
+        int cd = map->dist[idx];                                                                    \
+        if (cd == 0) {                                                                              \
+            map->dist[idx] = d;                                                                     \
+            map->buckets[idx] = entry;                                                              \
+            return;                                                                                 \
+        }                                                                                           \
+        if (cd < d) {                                                                               \
+            name##_hash_entry_t tmp = map->buckets[idx];                                            \
+            map->buckets[idx] = entry;                                                              \
+            map->dist[idx] = d;                                                                     \
+            entry = tmp;                                                                            \
+            d = cd;                                                                                 \
+        }                                                                                           \
+        idx = (idx + 1) & map->mask;                                                                \
+        if (++d == HASH_INT_MAX_DIST) {                                                             \
+            name##_rehash_hash_map(map, map->capacity * 2);                                         \
+            idx = hash_func(entry.key) >> map->shift;                                               \
+            d = 1;                                                                                  \
+        }                                                                                           \
+    }                                                                                               \
+}                                                                                                   \
+                                                                                                    \
+static inline void name##_rehash_hash_map(name##_hash_map_t *map, size_t capacity) {                \
+    uint8_t *dist = map->dist;                                                                      \
+    name##_hash_entry_t *buckets = map->buckets;                                                    \
+    size_t old_capacity = map->capacity;                                                            \
+    name##_alloc_hash_map(map, capacity);                                                           \
+    for (size_t i=0; i<old_capacity; i++) {                                                         \
+        if (dist[i]) name##_insert_hash_map(map, hash_func(buckets[i].key) >> map->shift, 1, buckets[i]); \
+    }                                                                                               \
+    free(dist);                                                                                     \
+    free(buckets);                                                                                  \
+}                                                                                                   \
+                                                                                                    \
+static inline int put_##name##_hash_map(name##_hash_map_t *map, key_t key, val_t val) {             \
+    size_t idx = hash_func(key) >> map->shift;                                                      \
+    int d = 1;                                                                                      \
+    for (;;) {                                                                                      \
+        int cd = map->dist[idx];                                                                    \
+        if (cd < d) break;                                                                          \
+        if (cd == d && map->buckets[idx].key == key) {                                              \
+            map->buckets[idx].val = val;                                                            \
+            return 0;                                                                               \
+        }                                                                                           \
+        idx = (idx + 1) & map->mask;                                                                \
+        d++;                                                                                        \
+    }                                                                                               \
+    name##_hash_entry_t entry = {key, val};                                                         \
+    if (map->num >= map->limit) {                                                                   \
+        name##_rehash_hash_map(map, map->capacity * 2);                                             \
+        idx = hash_func(key) >> map->shift;                                                         \
+        d = 1;                                                                                      \
+    }                                                                                               \
+    if (d == HASH_INT_MAX_DIST) {                                                                   \
+        name##_rehash_hash_map(map, map->capacity * 2);                                             \
+        idx = hash_func(key) >> map->shift;                                                         \
+        d = 1;                                                                                      \
+    }                                                                                               \
+    name##_insert_hash_map(map, idx, d, entry);                                                     \
+    map->num++;                                                                                     \
+    return 1;                                                                                       \
+}                                                                                                   \
+                                                                                                    \
+/*キーのインデックスを返す（存在しなければ-1）*/                                                        \
+static inline long name##_find_hash_map(name##_hash_map_t *map, key_t key) {                        \
+    size_t idx = hash_func(key) >> map->shift;                                                      \
+    for (int d=1;; d++) {                                                                           \
+        int cd = map->dist[idx];                                                                    \
+        if (cd < d) return -1;                                                                      \
+        if (cd == d && map->buckets[idx].key == key) return idx;                                    \
+        idx = (idx + 1) & map->mask;                                                                \
+    }                                                                                               \
+}                                                                                                   \
+                                                                                                    \
+static inline int get_##name##_hash_map(name##_hash_map_t *map, key_t key, val_t *val) {            \
+    long idx = name##_find_hash_map(map, key);                                                      \
+    if (idx < 0) return 0;                                                                          \
+    if (val) *val = map->buckets[idx].val;                                                          \
+    return 1;                                                                                       \
+}                                                                                                   \
+                                                                                                    \
+/*後続のエントリをホームに近づく方向に1つずつ詰める*/                                                    \
+static inline int del_##name##_hash_map(name##_hash_map_t *map, key_t key) {                        \
+    long idx = name##_find_hash_map(map, key);                                                      \
+    if (idx < 0) return 0;                                                                          \
+    for (;;) {                                                                                      \
+        size_t next = (idx + 1) & map->mask;                                                        \
+        if (map->dist[next] <= 1) break;                                                            \
+        map->buckets[idx] = map->buckets[next];                                                     \
+        map->dist[idx] = map->dist[next] - 1;                                                       \
+        idx = next;                                                                                 \
+    }                                                                                               \
+    map->dist[idx] = 0;                                                                             \
+    map->num--;                                                                                     \
+    return 1;                                                                                       \
+}                                                                                                   \
+                                                                                                    \
+static inline size_t num_##name##_hash_map(name##_hash_map_t *map) {                                \
+    return map->num;                                                                                \
+}                                                                                                   \
+                                                                                                    \
+/*データ数nまでリハッシュしないようにバケット配列を拡張する*/                                              \
+static inline void reserve_##name##_hash_map(name##_hash_map_t *map, size_t n) {                    \
+    size_t capacity = map->capacity;                                                                \
+    while (capacity * HASH_INT_MAX_CAPACITY / 100 <= n) capacity *= 2;                              \
+    if (capacity > map->capacity) name##_rehash_hash_map(map, capacity);                            \
+}                                                                                                   \
+                                                                                                    \
+/*posの位置から次のデータを探してkey,valに設定し1を返す（key,valにNULL指定可能）。なければ0を返す。*/          \
+/*イテレート中にput/delするとデータが移動するので、その後の結果は不定。*/                                    \
+static inline int next_##name##_hash_map(name##_hash_map_t *map, size_t *pos, key_t *key, val_t *val) { \
+    for (size_t i=*pos; i<map->capacity; i++) {                                                     \
+        if (!map->dist[i]) continue;                                                                \
+        if (key) *key = map->buckets[i].key;                                                        \
+        if (val) *val = map->buckets[i].val;                                                        \
+        *pos = i + 1;                                                                               \
+        return 1;                                                                                   \
+    }                                                                                               \
+    *pos = map->capacity;                                                                           \
+    return 0;                                                                                       \
+}
+
+//uint32_tのキーのハッシュマップ
+#define HASH_MAP_INIT_INT32(name, val_t) HASH_MAP_INIT_INT_TYPE(name, uint32_t, val_t, int32_hash)
+
+//uint64_tのキーのハッシュマップ
+#define HASH_MAP_INIT_INT64(name, val_t) HASH_MAP_INIT_INT_TYPE(name, uint64_t, val_t, int64_hash)
+
+#endif
@@ -4,11 +4,19 @@
 #include <string.h>
 #include <assert.h>
 
+#include <pthread.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
 #include "hashmap.h"
+#include "hashmap_int.h"
 
 //CPU時間とメモリを表示
+#include <time.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <malloc.h>
+#include <sys/mman.h>
 void print_usage(struct rusage *ru0) {
 #ifdef __linux__
     struct rusage ru;
@@ -42,12 +50,45 @@ void test_dump() {
     free_hash_map(hash_map);
 }
 
+//インライン・アリーナ境界前後の長さのキー
+void test_keylen(void) {
+    char key[256];
+    void *data;
+    int ret;
+    hash_map_t *hash_map = new_hash_map(0, NULL);
+    for (int len=0; len<(int)sizeof(key); len++) {
+        memset(key, 'a'+len%26, len);
+        ret = put_hash_map(hash_map, key, len, MAKE_DATA(len));
+        assert(ret==1);
+    }
+    for (int len=0; len<(int)sizeof(key); len+=2) {
+        memset(key, 'a'+len%26, len);
+        ret = del_hash_map(hash_map, key, len);
+        assert(ret==1);
+    }
+    for (int len=0; len<(int)sizeof(key); len++) {
+        memset(key, 'a'+len%26, len);
+        ret = get_hash_map(hash_map, key, len, &data);
+        assert(ret==len%2);
+        if (len%2) assert(data==MAKE_DATA(len));
+    }
+    iterator_t *iterator = iterate_hash_map(hash_map);
+    char *k;
+    int keylen;
+    while (next_iterate(iterator, &k, &keylen, &data)) {
+        assert(keylen%2 && data==MAKE_DATA(keylen));
+        for (int i=0; i<keylen; i++) assert(k[i]=='a'+keylen%26);
+    }
+    end_iterate(iterator);
+    free_hash_map(hash_map);
+}
+
 void test_iterate(hash_map_t *hash_map) {
     iterator_t *iterator = iterate_hash_map(hash_map);
     char *key  = NULL;
     int keylen = 0;
     void *data = NULL;
-    int cnt = 0;
+    size_t cnt = 0;
     while (next_iterate(iterator, &key, &keylen, &data)) {
         assert(key);
         assert(keylen);
@@ -58,16 +99,38 @@ void test_iterate(hash_map_t *hash_map) {
     }
     assert(cnt==num_hash_map(hash_map));
     end_iterate(iterator);
+
+    //スタック上のイテレータ、分割したイテレータでも全キーを1回ずつ返すこと
+    //確認用のハッシュマップを作るので、速度テストの大きなハッシュマップでは行わない
+    if (num_hash_map(hash_map) > 100*10000) return;
+    int ns[] = {1, 3, 16, 1000};
+    for (int t=0; t<(int)(sizeof(ns)/sizeof(int)); t++) {
+        iterator_t its[1000];
+        if (t==0) init_iterate(&its[0], hash_map);
+        else split_iterate_hash_map(hash_map, its, ns[t]);
+        hash_map_t *seen = new_hash_map(0, NULL);
+        for (int i=0; i<ns[t]; i++) {
+            while (next_iterate(&its[i], &key, &keylen, NULL)) {
+                int ret = put_hash_map(seen, key, keylen, NULL);
+                assert(ret==1);
+            }
+            int ret = next_iterate(&its[i], NULL, NULL, NULL);
+            assert(ret==0);
+        }
+        assert(num_hash_map(seen)==num_hash_map(hash_map));
+        free_hash_map(seen);
+    }
 }
 
 //size: データ数
-void test_hash_map(int size, hash_func_t hash_func, const char *func_name) {
-    fprintf(stderr, "=== %s: size=%d * 10, hash_map_func = %s\n",  __func__, size, func_name);
+//config: ハッシュマップの設定
+void test_hash_map(int size, hash_map_config_t config, const char *func_name) {
+    fprintf(stderr, "=== %s: size=%d * 10, hash_map_func = %s, flags=%d\n",  __func__, size, func_name, config.flags);
 
     int ret;
     char key[128];
     void *data;
-    hash_map_t *hash_map = new_hash_map(0, hash_func);
+    hash_map_t *hash_map = new_hash_map_config(&config);
     test_iterate(hash_map);
 
     // 0123456789
@@ -79,12 +142,14 @@ void test_hash_map(int size, hash_func_t hash_func, const char *func_name) {
     // 0123456789
 
     //新規追加
+    int n_put = 0;
     for (int i=0; i<6*size; i++) {
         MAKE_KEY(key, i);
         ret = put_hash_map(hash_map, key, strlen(key), MAKE_DATA(i));
         assert(ret==1);
+        n_put++;
     }
-    assert(num_hash_map(hash_map)==6*size);
+    assert(num_hash_map(hash_map)==(size_t)6*size);
 
     //既存削除
     for (int i=2*size; i<5*size; i++) {
@@ -99,6 +164,7 @@ void test_hash_map(int size, hash_func_t hash_func, const char *func_name) {
         MAKE_KEY(key, i);
         ret = put_hash_map(hash_map, key, strlen(key), MAKE_DATA(i));
         assert(ret==1);
+        n_put++;
     }
 
     //上書き+新規追加
@@ -106,8 +172,10 @@ void test_hash_map(int size, hash_func_t hash_func, const char *func_name) {
         MAKE_KEY(key, i);
         ret = put_hash_map(hash_map, key, strlen(key), MAKE_DATA(i));
         assert(ret==(i<6*size?0:1));
+        n_put += ret;
     }
     dump_hash_map(__func__, hash_map, 0);
+    fprintf(stderr, "= %s: alloc/insert=%.4f\n", __func__, (double)alloc_count_hash_map(hash_map)/n_put);
 
     //取得
     for (int i=0*size; i<2*size; i++) {
@@ -153,27 +221,1681 @@ void test_hash_map(int size, hash_func_t hash_func, const char *func_name) {
     free_hash_map(NULL);
 }
 
+//削除と追加を繰り返してもデータ数と検索結果が保たれること
+//size: 常に保持するデータ数
+void test_churn(int size) {
+    fprintf(stderr, "=== %s: size=%d\n",  __func__, size);
+    char key[128];
+    void *data;
+    int ret;
+    hash_map_t *hash_map = new_hash_map(0, NULL);
+    for (int i=0; i<size; i++) {
+        MAKE_KEY(key, i);
+        ret = put_hash_map(hash_map, key, strlen(key), MAKE_DATA(i));
+        assert(ret==1);
+    }
+    for (int i=size; i<20*size; i++) {
+        int old = i-size;
+        MAKE_KEY(key, old);
+        ret = del_hash_map(hash_map, key, strlen(key));
+        assert(ret==1);
+        ret = get_hash_map(hash_map, key, strlen(key), NULL);
+        assert(ret==0);
+        MAKE_KEY(key, i);
+        ret = put_hash_map(hash_map, key, strlen(key), MAKE_DATA(i));
+        assert(ret==1);
+    }
+    assert(num_hash_map(hash_map)==(size_t)size);
+    for (int i=0; i<20*size; i++) {
+        MAKE_KEY(key, i);
+        ret = get_hash_map(hash_map, key, strlen(key), &data);
+        assert(ret==(i>=19*size));
+        if (ret) assert(data==MAKE_DATA(i));
+    }
+    dump_hash_map(__func__, hash_map, 0);
+    free_hash_map(hash_map);
+}
+
+//キー配列を作成する（keys[i]はMAKE_KEY(i)）
+static char **make_keys(int n, int **keylens) {
+    char key[128];
+    char **keys = malloc(n * sizeof(char*));
+    *keylens = malloc(n * sizeof(int));
+    assert(keys && *keylens);
+    for (int i=0; i<n; i++) {
+        MAKE_KEY(key, i);
+        keys[i] = strdup(key);
+        (*keylens)[i] = strlen(key);
+    }
+    return keys;
+}
+static void free_keys(char **keys, int *keylens, int n) {
+    for (int i=0; i<n; i++) free(keys[i]);
+    free(keys);
+    free(keylens);
+}
+
+//イテレートした順にputしてコピーするテスト
+//バケット順のキーを小さいバケット配列に挿入しても前方に集中せず、キーを順にputするのと同程度の時間で済むこと。
+void test_copy(int size) {
+    fprintf(stderr, "=== %s: size=%d\n",  __func__, size);
+    int *keylens;
+    char **keys = make_keys(size, &keylens);
+    struct timespec t0, t1, t2;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    hash_map_t *hash_map = new_hash_map(0, NULL);
+    for (int i=0; i<size; i++) put_hash_map(hash_map, keys[i], keylens[i], MAKE_DATA(i));
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    hash_map_t *copy = new_hash_map(0, NULL);
+    iterator_t it;
+    char *key;
+    int keylen;
+    void *data;
+    int ret;
+    init_iterate(&it, hash_map);
+    while (next_iterate(&it, &key, &keylen, &data)) {
+        ret = put_hash_map(copy, key, keylen, data);
+        assert(ret==1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    double put_sec = (t1.tv_sec-t0.tv_sec) + (t1.tv_nsec-t0.tv_nsec)*1e-9;
+    double copy_sec = (t2.tv_sec-t1.tv_sec) + (t2.tv_nsec-t1.tv_nsec)*1e-9;
+    fprintf(stderr, "put %.3f sec, copy %.3f sec\n", put_sec, copy_sec);
+    assert(copy_sec < put_sec * 4 + 0.05);
+    assert(num_hash_map(copy)==(size_t)size);
+    for (int i=0; i<size; i++) {
+        void *d;
+        ret = get_hash_map(copy, keys[i], keylens[i], &d);
+        assert(ret==1 && d==MAKE_DATA(i));
+    }
+    free_hash_map(copy);
+    free_hash_map(hash_map);
+    free_keys(keys, keylens, size);
+}
+
+//バッチAPIが1件ずつのAPIと同じ結果になること
+void test_batch(int size, int flags) {
+    fprintf(stderr, "=== %s: size=%d, flags=%d\n",  __func__, size, flags);
+    int *keylens;
+    char **keys = make_keys(2*size, &keylens);
+    void **data = malloc(2*size * sizeof(void*));
+    int *found = malloc(2*size * sizeof(int));
+    assert(data && found);
+
+    hash_map_config_t config = {.flags=flags};
+    hash_map_t *hash_map = new_hash_map_config(&config);
+    //前半を追加してから、全体を上書き+追加
+    for (int i=0; i<size; i++) data[i] = MAKE_DATA(i);
+    size_t n = put_hash_map_batch(hash_map, (const char**)keys, keylens, data, size/2);
+    assert(n==(size_t)size/2);
+    for (int i=0; i<size; i++) data[i] = MAKE_DATA(size+i);
+    n = put_hash_map_batch(hash_map, (const char**)keys, keylens, data, size);
+    assert(n==(size_t)(size-size/2));
+    assert(num_hash_map(hash_map)==(size_t)size);
+
+    //後半のキーは存在しない
+    n = get_hash_map_batch(hash_map, (const char**)keys, keylens, 2*size, data, found);
+    assert(n==(size_t)size);
+    for (int i=0; i<2*size; i++) {
+        void *d = NULL;
+        assert(found[i]==(i<size));
+        int ret = get_hash_map(hash_map, keys[i], keylens[i], &d);
+        assert(ret==found[i]);
+        assert(data[i]==d);
+        assert(data[i]==(i<size ? MAKE_DATA(size+i) : NULL));
+    }
+    n = get_hash_map_batch(hash_map, (const char**)keys, keylens, 2*size, NULL, NULL);
+    assert(n==(size_t)size);
+    free_hash_map(hash_map);
+    free_keys(keys, keylens, 2*size);
+    free(data);
+    free(found);
+}
+
+//バッチAPIとget_hash_mapのループの比較
+//size: データ数（LLCより十分大きいハッシュマップになるようにする）
+void test_batch_speed(int size) {
+    printf("== Batch Speed Test: n=%d\n", size);
+    int *keylens;
+    char **keys = make_keys(size, &keylens);
+    void **data = malloc(size * sizeof(void*));
+    assert(data);
+    hash_map_t *hash_map = new_hash_map(0, NULL);
+    for (int i=0; i<size; i++) put_hash_map(hash_map, keys[i], keylens[i], MAKE_DATA(i));
+    //ランダムな順番で検索する
+    for (int i=size-1; i>0; i--) {
+        int j = rand() % (i+1);
+        char *k = keys[i]; keys[i] = keys[j]; keys[j] = k;
+        int l = keylens[i]; keylens[i] = keylens[j]; keylens[j] = l;
+    }
+    struct timespec t0, t1, t2;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int n1 = 0;
+    for (int i=0; i<size; i++) n1 += get_hash_map(hash_map, keys[i], keylens[i], &data[i]);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    int n2 = 0;
+    for (int i=0; i<size; i+=1000) {
+        int n = size-i<1000 ? size-i : 1000;
+        n2 += get_hash_map_batch(hash_map, (const char**)keys+i, keylens+i, n, data+i, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    assert(n1==size && n2==size);
+    printf("get:       %.1f ns/key\n", ((t1.tv_sec-t0.tv_sec)*1e9 + (t1.tv_nsec-t0.tv_nsec))/size);
+    printf("get_batch: %.1f ns/key\n", ((t2.tv_sec-t1.tv_sec)*1e9 + (t2.tv_nsec-t1.tv_nsec))/size);
+    free_hash_map(hash_map);
+
+    hash_map = new_hash_map(0, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i=0; i<size; i++) put_hash_map(hash_map, keys[i], keylens[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    free_hash_map(hash_map);
+    hash_map = new_hash_map(0, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    for (int i=0; i<size; i+=1000) {
+        int n = size-i<1000 ? size-i : 1000;
+        put_hash_map_batch(hash_map, (const char**)keys+i, keylens+i, NULL, n);
+    }
+    struct timespec t3;
+    clock_gettime(CLOCK_MONOTONIC, &t3);
+    assert(num_hash_map(hash_map)==(size_t)size);
+    printf("put:       %.1f ns/key\n", ((t1.tv_sec-t0.tv_sec)*1e9 + (t1.tv_nsec-t0.tv_nsec))/size);
+    printf("put_batch: %.1f ns/key\n", ((t3.tv_sec-t2.tv_sec)*1e9 + (t3.tv_nsec-t2.tv_nsec))/size);
+    free_hash_map(hash_map);
+    free_keys(keys, keylens, size);
+    free(data);
+}
+
+//reserve/shrink/compactのテスト
+void test_reserve(int size, int flags) {
+    fprintf(stderr, "=== %s: size=%d, flags=%d\n",  __func__, size, flags);
+    int *keylens;
+    char **keys = make_keys(size, &keylens);
+    hash_map_t *hash_map = new_hash_map_config(&(hash_map_config_t){.flags=flags});
+    reserve_hash_map(hash_map, size);
+    //リハッシュしないので、メモリ確保はキーアリーナのチャンクだけ
+    long n_alloc = alloc_count_hash_map(hash_map);
+    long key_bytes = 0;
+    for (int i=0; i<size; i++) {
+        put_hash_map(hash_map, keys[i], keylens[i], MAKE_DATA(i));
+        if (keylens[i] > 16) key_bytes += keylens[i];
+    }
+    assert(alloc_count_hash_map(hash_map) - n_alloc <= key_bytes/(64*1024) + 1);
+    reserve_hash_map(hash_map, size/2);
+    assert(alloc_count_hash_map(hash_map) - n_alloc <= key_bytes/(64*1024) + 1);
+
+    //9割削除して縮小する
+    for (int i=0; i<size; i++) {
+        if (i%10==0) continue;
+        int ret = del_hash_map(hash_map, keys[i], keylens[i]);
+        assert(ret==1);
+    }
+    //削除で始まったコンパクション（HASH_MAP_INCREMENTALでは少しずつ進む）の途中でも取得できること
+    for (int i=0; i<size; i+=10) {
+        void *d = NULL;
+        int ret = get_hash_map(hash_map, keys[i], keylens[i], &d);
+        assert(ret==1 && d==MAKE_DATA(i));
+    }
+    n_alloc = alloc_count_hash_map(hash_map);
+    shrink_hash_map(hash_map);
+    assert(alloc_count_hash_map(hash_map) > n_alloc);
+    assert(num_hash_map(hash_map)==(size_t)(size+9)/10);
+    for (int i=0; i<size; i++) {
+        void *d = NULL;
+        int ret = get_hash_map(hash_map, keys[i], keylens[i], &d);
+        assert(ret==(i%10==0));
+        assert(d==(i%10 ? NULL : MAKE_DATA(i)));
+    }
+    //同じサイズでは何もしない
+    n_alloc = alloc_count_hash_map(hash_map);
+    shrink_hash_map(hash_map);
+    compact_hash_map(hash_map);
+    assert(alloc_count_hash_map(hash_map)==n_alloc);
+
+    //縮小後も追加・削除できること
+    for (int i=0; i<size; i++) put_hash_map(hash_map, keys[i], keylens[i], MAKE_DATA(i));
+    assert(num_hash_map(hash_map)==(size_t)size);
+    for (int i=0; i<size; i++) {
+        int ret = del_hash_map(hash_map, keys[i], keylens[i]);
+        assert(ret==1);
+    }
+    shrink_hash_map(hash_map);
+    assert(num_hash_map(hash_map)==0);
+    free_hash_map(hash_map);
+    free_keys(keys, keylens, size);
+}
+
+//upsert/find_slotで数えた結果がget+putと同じになること
+//キーi*7919%sizeを3*size回数える（sizeが7919の倍数でなければ最初のsize回で全キーが現れる）。
+void test_upsert(int size, int flags) {
+    fprintf(stderr, "=== %s: size=%d, flags=%d\n",  __func__, size, flags);
+    int *keylens;
+    char **keys = make_keys(size, &keylens);
+    hash_map_t *hash_map = new_hash_map_config(&(hash_map_config_t){.flags=flags});
+    hash_map_t *ref = new_hash_map_config(&(hash_map_config_t){.flags=flags});
+    for (int i=0; i<3*size; i++) {
+        int k = (int)((uint64_t)i * 7919 % size);
+        int inserted = -1;
+        void **slot = upsert_hash_map(hash_map, keys[k], keylens[k], &inserted);
+        assert(inserted==(i<size));
+        assert(!inserted || *slot==NULL);
+        *slot = (char*)*slot + 1;
+        void *d = NULL;
+        get_hash_map(ref, keys[k], keylens[k], &d);
+        put_hash_map(ref, keys[k], keylens[k], (char*)d + 1);
+    }
+    assert(num_hash_map(hash_map)==(size_t)size);
+    for (int i=0; i<size; i++) {
+        void *d1 = NULL, *d2 = NULL;
+        int ret1 = get_hash_map(hash_map, keys[i], keylens[i], &d1);
+        int ret2 = get_hash_map(ref, keys[i], keylens[i], &d2);
+        assert(ret1 && ret2);
+        assert(d1==d2 && d1==MAKE_DATA(3));
+    }
+    //既存のキーではメモリを確保しない
+    long n_alloc = alloc_count_hash_map(hash_map);
+    for (int i=0; i<size; i++) {
+        void **slot = find_slot_hash_map(hash_map, keys[i], keylens[i]);
+        assert(slot && *slot==MAKE_DATA(3));
+        *slot = MAKE_DATA(i);
+        int inserted;
+        void **slot2 = upsert_hash_map(hash_map, keys[i], keylens[i], &inserted);
+        assert(slot2==slot && !inserted);
+    }
+    assert(alloc_count_hash_map(hash_map)==n_alloc);
+    for (int i=0; i<size; i++) {
+        void *d = NULL;
+        int ret = get_hash_map(hash_map, keys[i], keylens[i], &d);
+        assert(ret && d==MAKE_DATA(i));
+        if (i%2) {
+            ret = del_hash_map(hash_map, keys[i], keylens[i]);
+            assert(ret);
+        }
+    }
+    for (int i=0; i<size; i++) assert((find_slot_hash_map(hash_map, keys[i], keylens[i])!=NULL)==(i%2==0));
+    assert(find_slot_hash_map(hash_map, "", 0)==NULL);
+    assert(num_hash_map(hash_map)==(size_t)(size+1)/2);
+    free_hash_map(hash_map);
+    free_hash_map(ref);
+    free_keys(keys, keylens, size);
+}
+
+//全件スキャンのスループット（スレッド数毎）
+//使用率が高い場合と、7/8を削除して疎にした場合を計測する。
+typedef struct {
+    iterator_t *iterator;
+    long n;
+} scan_arg_t;
+static void *scan_thread(void *p) {
+    scan_arg_t *arg = p;
+    int keylen;
+    long n = 0;
+    while (next_iterate(arg->iterator, NULL, &keylen, NULL)) n += keylen > 0;
+    arg->n = n;
+    return NULL;
+}
+void test_scan_speed(int size) {
+    printf("== Scan Speed Test: n=%d\n", size);
+    int *keylens;
+    char **keys = make_keys(size, &keylens);
+    long n_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_cpu < 1) n_cpu = 1;
+    int max_th = n_cpu < 4 ? 4 : n_cpu;
+    pthread_t *th = malloc(max_th * sizeof(pthread_t));
+    iterator_t *its = malloc(max_th * sizeof(iterator_t));
+    scan_arg_t *arg = malloc(max_th * sizeof(scan_arg_t));
+    assert(th && its && arg);
+    for (int sparse=0; sparse<2; sparse++) {
+        hash_map_t *hash_map = build_hash_map(&(hash_map_config_t){0}, (const char**)keys, keylens, NULL, size, 0);
+        int num = size;
+        if (sparse) {
+            for (int i=0; i<size; i++) if (i%8) del_hash_map(hash_map, keys[i], keylens[i]);
+            num = num_hash_map(hash_map);
+        }
+        hash_map_stats_t stats;
+        stats_hash_map(hash_map, &stats);
+        for (int n_th=1; n_th<=max_th; n_th*=2) {
+            struct timespec t0, t1;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            split_iterate_hash_map(hash_map, its, n_th);
+            for (int i=0; i<n_th; i++) {
+                arg[i].iterator = &its[i];
+                pthread_create(&th[i], NULL, scan_thread, &arg[i]);
+            }
+            long n = 0;
+            for (int i=0; i<n_th; i++) {
+                pthread_join(th[i], NULL);
+                n += arg[i].n;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            assert(n==num);
+            double sec = (t1.tv_sec-t0.tv_sec) + (t1.tv_nsec-t0.tv_nsec)*1e-9;
+            printf("load=%4.1f%% threads=%-3d %.3f sec, %.1f M entries/s\n", stats.load_factor*100, n_th, sec, num/sec/1e6);
+        }
+        free_hash_map(hash_map);
+    }
+    free(th);
+    free(its);
+    free(arg);
+    free_keys(keys, keylens, size);
+}
+
+//単語数え上げ：get+putとupsertの比較
+//n_key種類のキーをsize回数える。
+void test_upsert_speed(int size, int n_key) {
+    printf("== Upsert Speed Test: n=%d, keys=%d\n", size, n_key);
+    int *keylens;
+    char **keys = make_keys(n_key, &keylens);
+    int *order = malloc(size * sizeof(int));
+    assert(order);
+    for (int i=0; i<size; i++) order[i] = (int)((uint64_t)i * 2654435761u % n_key);
+    for (int type=0; type<2; type++) {
+        hash_map_t *hash_map = new_hash_map(0, NULL);
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i=0; i<size; i++) {
+            int k = order[i];
+            if (type==0) {
+                void *d = NULL;
+                get_hash_map(hash_map, keys[k], keylens[k], &d);
+                put_hash_map(hash_map, keys[k], keylens[k], (char*)d + 1);
+            } else {
+                void **slot = upsert_hash_map(hash_map, keys[k], keylens[k], NULL);
+                *slot = (char*)*slot + 1;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double sec = (t1.tv_sec-t0.tv_sec) + (t1.tv_nsec-t0.tv_nsec)*1e-9;
+        printf("%-8s %.3f sec, %.1f ns/op\n", type ? "upsert" : "get+put", sec, sec*1e9/size);
+        free_hash_map(hash_map);
+    }
+    free(order);
+    free_keys(keys, keylens, n_key);
+}
+
+//キャッシュ（HASH_MAP_CACHE）のテスト
+//追い出したキーをevicted（キー→1）に記録する。
+static void cache_evict(const char *key, int keylen, void *data, void *arg) {
+    hash_map_t *evicted = arg;
+    (void)data;
+    int ret = put_hash_map(evicted, key, keylen, MAKE_DATA(1));
+    assert(ret==1);
+}
+void test_cache(int size) {
+    fprintf(stderr, "=== %s: size=%d\n",  __func__, size);
+    int *keylens;
+    char **keys = make_keys(size, &keylens);
+    int max_num = size / 10;
+    int n_hot = 10;
+    hash_map_t *evicted = new_hash_map(0, NULL);
+    hash_map_config_t config = {.flags=HASH_MAP_CACHE, .max_num=max_num, .evict_func=cache_evict, .evict_arg=evicted};
+    hash_map_t *hash_map = new_hash_map_config(&config);
+    hash_map_stats_t stats;
+    stats_hash_map(hash_map, &stats);
+    size_t capacity = stats.capacity;
+    long n_alloc = alloc_count_hash_map(hash_map);
+
+    //先頭n_hot個を追加毎に参照しながら全キーを追加する
+    for (int i=0; i<size; i++) {
+        put_hash_map(hash_map, keys[i], keylens[i], MAKE_DATA(i));
+        assert(num_hash_map(hash_map)==(size_t)(i < max_num ? i+1 : max_num));
+        for (int h=0; h<n_hot && h<=i; h++) {
+            int ret = get_hash_map(hash_map, keys[h], keylens[h], NULL);
+            assert(ret);
+        }
+    }
+    stats_hash_map(hash_map, &stats);
+    assert(stats.capacity==capacity && stats.rehash_count==0);
+    assert(stats.evictions==size - max_num && num_hash_map(evicted)==(size_t)(size - max_num));
+    //リハッシュしないので、メモリ確保はキーアリーナのチャンクだけ
+    assert(alloc_count_hash_map(hash_map) - n_alloc < size/100);
+
+    //各キーはハッシュマップに残っているか、1回だけ追い出されている
+    for (int i=0; i<size; i++) {
+        void *d = NULL;
+        int in_map = get_hash_map(hash_map, keys[i], keylens[i], &d);
+        int in_evicted = get_hash_map(evicted, keys[i], keylens[i], NULL);
+        assert(in_map + in_evicted==1);
+        if (in_map) assert(d==MAKE_DATA(i));
+        //参照し続けたキーは残る
+        if (i < n_hot) assert(in_map);
+    }
+    //上書きでは追い出さない、削除すると空きができる
+    put_hash_map(hash_map, keys[0], keylens[0], MAKE_DATA(0));
+    int ret = del_hash_map(hash_map, keys[1], keylens[1]);
+    assert(ret==1);
+    put_hash_map(hash_map, keys[1], keylens[1], MAKE_DATA(1));
+    stats_hash_map(hash_map, &stats);
+    assert(stats.evictions==size - max_num);
+    //reserve/shrinkでバケット配列は変わらない
+    reserve_hash_map(hash_map, size);
+    shrink_hash_map(hash_map);
+    stats_hash_map(hash_map, &stats);
+    assert(stats.capacity==capacity);
+    free_hash_map(hash_map);
+    free_hash_map(evicted);
+    free_keys(keys, keylens, size);
+}
+
+//キャッシュのgetのヒットと、追い出しを伴うputの速度（通常のハッシュマップとの比較）
+void test_cache_speed(int size) {
+    printf("== Cache Speed Test: n=%d\n", size);
+    int *keylens;
+    char **keys = make_keys(size, &keylens);
+    for (int type=0; type<2; type++) {
+        hash_map_config_t config = {0};
+        if (type) config = (hash_map_config_t){.flags=HASH_MAP_CACHE, .max_num=size};
+        hash_map_t *hash_map = new_hash_map_config(&config);
+        for (int i=0; i<size; i++) put_hash_map(hash_map, keys[i], keylens[i], MAKE_DATA(i));
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        long found = 0;
+        for (int i=0; i<size; i++) {
+            int k = (int)((uint64_t)i * 7919 % size);
+            found += get_hash_map(hash_map, keys[k], keylens[k], NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        assert(found==size);
+        double sec = (t1.tv_sec-t0.tv_sec) + (t1.tv_nsec-t0.tv_nsec)*1e-9;
+        printf("%-8s get(hit) %.1f ns/op\n", type ? "cache" : "hash_map", sec*1e9/size);
+        free_hash_map(hash_map);
+    }
+    //半分の上限で全キーを2周putする（キャッシュが満杯になってからは毎回追い出す）
+    hash_map_t *hash_map = new_hash_map_config(&(hash_map_config_t){.flags=HASH_MAP_CACHE, .max_num=size/2});
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i=0; i<2*size; i++) put_hash_map(hash_map, keys[i%size], keylens[i%size], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    hash_map_stats_t stats;
+    stats_hash_map(hash_map, &stats);
+    double sec = (t1.tv_sec-t0.tv_sec) + (t1.tv_nsec-t0.tv_nsec)*1e-9;
+    printf("cache    put(evict) %.1f ns/op, evictions=%ld\n", sec*1e9/(2*size), stats.evictions);
+    free_hash_map(hash_map);
+    free_keys(keys, keylens, size);
+}
+
+//確保したバイト数を数えるアロケータ
+typedef struct {
+    long n_alloc, n_free;
+    long bytes;
+} count_allocator_t;
+static void *count_alloc(size_t size, void *arg) {
+    count_allocator_t *a = arg;
+    __atomic_add_fetch(&a->n_alloc, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&a->bytes, size, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+static void count_free(void *p, size_t size, void *arg) {
+    count_allocator_t *a = arg;
+    __atomic_add_fetch(&a->n_free, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&a->bytes, size, __ATOMIC_RELAXED);
+    free(p);
+}
+
+//アロケータとヒュージページのテスト
+//確保と解放の回数とサイズが一致すること。
+void test_allocator(int size, int flags) {
+    fprintf(stderr, "=== %s: size=%d, flags=%d\n",  __func__, size, flags);
+    int *keylens;
+    char **keys = make_keys(size, &keylens);
+    count_allocator_t count = {0};
+    hash_map_config_t config = {.flags=flags, .allocator={count_alloc, count_free, &count}};
+    for (int type=0; type<3; type++) {
+        hash_map_t *hash_map = NULL;
+        if (type==0) {
+            hash_map = new_hash_map_config(&config);
+            for (int i=0; i<size; i++) put_hash_map(hash_map, keys[i], keylens[i], MAKE_DATA(i));
+            for (int i=0; i<size; i+=2) del_hash_map(hash_map, keys[i], keylens[i]);
+            shrink_hash_map(hash_map);
+        } else if (type==1) {
+            hash_map = build_hash_map(&config, (const char**)keys, keylens, NULL, size, 4);
+        } else {
+            shard_hash_map_t *shard_map = new_shard_hash_map(4, &config);
+            for (int i=0; i<size; i++) put_shard_hash_map(shard_map, keys[i], keylens[i], MAKE_DATA(i));
+            assert(count.n_alloc > 0);
+            free_shard_hash_map(shard_map);
+        }
+        if (hash_map) {
+            assert(count.n_alloc > 0 && count.bytes > 0);
+            assert(count.n_alloc - count.n_free <= alloc_count_hash_map(hash_map));
+            free_hash_map(hash_map);
+        }
+        assert(count.n_alloc==count.n_free && count.bytes==0);
+    }
+    //2MB以上のバケット配列だけヒュージページにする
+    hash_map_t *hash_map = new_hash_map_config(&config);
+    hash_map_stats_t stats;
+    stats_hash_map(hash_map, &stats);
+    assert(!stats.huge_pages);
+    reserve_hash_map(hash_map, 100000);
+    stats_hash_map(hash_map, &stats);
+    if (flags & HASH_MAP_HUGE_PAGES) fprintf(stderr, "huge_pages=%d\n", stats.huge_pages);
+    else assert(!stats.huge_pages);
+    for (int i=0; i<size; i++) put_hash_map(hash_map, keys[i], keylens[i], MAKE_DATA(i));
+    for (int i=0; i<size; i++) {
+        void *d;
+        assert(get_hash_map(hash_map, keys[i], keylens[i], &d) && d==MAKE_DATA(i));
+    }
+    free_hash_map(hash_map);
+    assert(count.n_alloc==count.n_free && count.bytes==0);
+    free_keys(keys, keylens, size);
+}
+
+//プロセスのAnonHugePages（KB）
+static long anon_huge_kb(void) {
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+    if (!fp) return -1;
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "AnonHugePages: %ld kB", &kb)==1) break;
+    }
+    fclose(fp);
+    return kb;
+}
+
+//LLCより大きいハッシュマップのランダムな検索（ヒュージページの有無）
+//キーは8バイトの整数（エントリ内に保存）なので、バケット配列へのアクセスだけを計測する。
+#define HUGE_SPEED_OPS  (1000*10000)
+void test_huge_page_speed(int size) {
+    printf("== Huge Page Speed Test: n=%d\n", size);
+    for (int huge=0; huge<2; huge++) {
+        hash_map_t *hash_map = new_hash_map_config(&(hash_map_config_t){.flags=huge ? HASH_MAP_HUGE_PAGES : 0});
+        reserve_hash_map(hash_map, size);
+        for (uint64_t i=0; i<(uint64_t)size; i++) put_hash_map(hash_map, (char*)&i, 8, MAKE_DATA(i));
+        hash_map_stats_t stats;
+        stats_hash_map(hash_map, &stats);
+        uint64_t x = 88172645463325252ULL;
+        long found = 0;
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i=0; i<HUGE_SPEED_OPS; i++) {
+            x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+            uint64_t k = x % size;
+            found += get_hash_map(hash_map, (char*)&k, 8, NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        assert(found==HUGE_SPEED_OPS);
+        double sec = (t1.tv_sec-t0.tv_sec) + (t1.tv_nsec-t0.tv_nsec)*1e-9;
+        printf("huge_pages=%d table=%zu MB AnonHugePages=%ld MB  %.1f ns/op, %.2f Mops/s\n", stats.huge_pages,
+            stats.capacity * (size_t)33 >> 20, anon_huge_kb() >> 10, sec*1e9/HUGE_SPEED_OPS, HUGE_SPEED_OPS/sec/1e6);
+        free_hash_map(hash_map);
+    }
+}
+
+//触ったページだけメモリを使うアロケータ（MAP_NORESERVEでmmapする）
+static void *lazy_alloc(size_t size, void *arg) {
+    (void)arg;
+    void *p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    return p==MAP_FAILED ? NULL : p;
+}
+static void lazy_free(void *p, size_t size, void *arg) {
+    (void)arg;
+    munmap(p, size);
+}
+
+//2^bitsバケットのハッシュマップのテスト（2^31を超えるインデックス）
+//バケット配列はまばらに使うので、メモリは制御バイト（2^bitsバイト）と触ったページの分だけ必要。
+//後半の範囲のイテレータでインデックスが2^(bits-1)以上のエントリを数え、縮小して同じデータを検索する。
+void test_large_index(int bits, int size) {
+    fprintf(stderr, "=== %s: bits=%d, size=%d\n",  __func__, bits, size);
+    hash_map_config_t config = {.hash64_func=wy_hash, .allocator={lazy_alloc, lazy_free, NULL}};
+    hash_map_t *hash_map = new_hash_map_config(&config);
+    size_t capacity = (size_t)1 << bits;
+    reserve_hash_map(hash_map, capacity * 7 / 10);
+    hash_map_stats_t stats;
+    stats_hash_map(hash_map, &stats);
+    assert(stats.capacity==capacity);
+    int ret;
+    for (uint64_t i=0; i<(uint64_t)size; i++) {
+        uint64_t k = i * 0x9E3779B97F4A7C15ULL;
+        ret = put_hash_map(hash_map, (char*)&k, 8, MAKE_DATA(i));
+        assert(ret==1);
+    }
+    assert(num_hash_map(hash_map)==(size_t)size);
+    for (uint64_t i=0; i<(uint64_t)size; i++) {
+        uint64_t k = i * 0x9E3779B97F4A7C15ULL;
+        void *d;
+        ret = get_hash_map(hash_map, (char*)&k, 8, &d);
+        assert(ret==1 && d==MAKE_DATA(i));
+    }
+    for (uint64_t i=0; i<(uint64_t)size; i+=2) {
+        uint64_t k = i * 0x9E3779B97F4A7C15ULL;
+        ret = del_hash_map(hash_map, (char*)&k, 8);
+        assert(ret==1);
+    }
+    stats_hash_map(hash_map, &stats);
+    hash_map_probe_stats_t probe;
+    probe_stats_hash_map(hash_map, &probe);
+    assert(stats.num==(size_t)size/2 && probe.max_probe < 4);
+
+    iterator_t its[2];
+    split_iterate_hash_map(hash_map, its, 2);
+    assert(its[1].next_idx==capacity/2 && its[1].end_idx==capacity);
+    size_t cnt[2] = {0};
+    for (int t=0; t<2; t++) {
+        while (next_iterate(&its[t], NULL, NULL, NULL)) cnt[t]++;
+    }
+    fprintf(stderr, "lower=%zu, upper=%zu\n", cnt[0], cnt[1]);
+    assert(cnt[0] > 0 && cnt[1] > 0 && cnt[0] + cnt[1]==(size_t)size/2);
+
+    shrink_hash_map(hash_map);
+    stats_hash_map(hash_map, &stats);
+    assert(stats.capacity < capacity);
+    for (uint64_t i=0; i<(uint64_t)size; i++) {
+        uint64_t k = i * 0x9E3779B97F4A7C15ULL;
+        void *d;
+        ret = get_hash_map(hash_map, (char*)&k, 8, &d);
+        assert(ret==(int)(i&1) && (!ret || d==MAKE_DATA(i)));
+    }
+    free_hash_map(hash_map);
+}
+
+//統計情報のテスト
+void test_stats(int size, int flags) {
+    fprintf(stderr, "=== %s: size=%d, flags=%d\n",  __func__, size, flags);
+    int *keylens;
+    char **keys = make_keys(size, &keylens);
+    hash_map_t *hash_map = new_hash_map_config(&(hash_map_config_t){.flags=flags});
+    hash_map_stats_t stats;
+    hash_map_probe_stats_t probe;
+
+    //空のハッシュマップ
+    stats_hash_map(hash_map, &stats);
+    probe_stats_hash_map(hash_map, &probe);
+    assert(stats.num==0 && stats.capacity==16 && probe.max_probe==0 && probe.avg_probe==0);
+    assert(stats.rehash_count==0 && !stats.rehashing);
+    dump_hash_map(__func__, hash_map, 0);
+
+    for (int i=0; i<size; i++) put_hash_map(hash_map, keys[i], keylens[i], MAKE_DATA(i));
+    for (int i=0; i<size; i+=2) put_hash_map(hash_map, keys[i], keylens[i], MAKE_DATA(i));
+    for (int i=0; i<size; i++) get_hash_map(hash_map, keys[i], keylens[i] - (i%4==0), NULL);
+    for (int i=0; i<size; i+=3) del_hash_map(hash_map, keys[i], keylens[i]);
+    int num = num_hash_map(hash_map);
+    stats_hash_map(hash_map, &stats);
+    probe_stats_hash_map(hash_map, &probe);
+    dump_hash_map(__func__, hash_map, 0);
+    //ヒストグラムの合計はデータ数（リハッシュ中は旧バケット配列の分も含む）
+    size_t sum = 0;
+    int max = 0;
+    for (int d=0; d<HASH_MAP_PROBE_HIST; d++) {
+        sum += probe.probe_hist[d];
+        if (probe.probe_hist[d]) max = d;
+    }
+    assert(sum==(size_t)num && stats.num==(size_t)num);
+    assert(probe.max_probe >= max && (probe.max_probe==max || max==HASH_MAP_PROBE_HIST-1));
+    assert(probe.avg_probe <= probe.max_probe);
+    assert(stats.rehash_count > 0 && stats.rehash_sec > 0);
+    assert(stats.load_factor <= 0.7 + 1e-9);
+    assert(stats.rehashing==(stats.migrate_left > 0));
+    if (stats.op_stats) {
+        assert(stats.inserts==size && stats.overwrites==(size+1)/2);
+        assert(stats.hits==size - (size+3)/4 && stats.misses==(size+3)/4);
+        assert(stats.deletes==(size+2)/3);
+    }
+    //読み込み専用で変更しない
+    hash_map_stats_t stats2;
+    hash_map_probe_stats_t probe2;
+    probe_stats_hash_map(hash_map, &probe2);
+    stats_hash_map(hash_map, &stats2);
+    assert(memcmp(&stats, &stats2, sizeof(stats))==0 && memcmp(&probe, &probe2, sizeof(probe))==0);
+
+    //すべて削除すると探索距離は残らない（後方シフトで削除するのでTOMBSTONEはない）
+    for (int i=0; i<size; i++) del_hash_map(hash_map, keys[i], keylens[i]);
+    stats_hash_map(hash_map, &stats);
+    probe_stats_hash_map(hash_map, &probe);
+    assert(stats.num==0 && probe.max_probe==0 && probe.avg_probe==0);
+    dump_hash_map(__func__, hash_map, 0);
+    free_hash_map(hash_map);
+    free_keys(keys, keylens, size);
+}
+
+//一括構築がputのループと同じ結果になること
+//末尾のsize/8個のキーは先頭の重複（後のデータが残る）
+void test_build(int size, int n_thread) {
+    fprintf(stderr, "=== %s: size=%d, n_thread=%d\n",  __func__, size, n_thread);
+    int n = size + size/8;
+    int *keylens;
+    char **keys = make_keys(n, &keylens);
+    void **data = malloc(n * sizeof(void*));
+    assert(data);
+    for (int i=0; i<n; i++) {
+        if (i >= size) {
+            free(keys[i]);
+            keys[i] = strdup(keys[i-size]);
+            keylens[i] = keylens[i-size];
+        }
+        data[i] = MAKE_DATA(i);
+    }
+    hash_map_t *expect = new_hash_map(0, NULL);
+    for (int i=0; i<n; i++) put_hash_map(expect, keys[i], keylens[i], data[i]);
+    hash_map_t *hash_map = build_hash_map(&(hash_map_config_t){0}, (const char**)keys, keylens, data, n, n_thread);
+    assert(num_hash_map(hash_map)==(size_t)size);
+    for (int i=0; i<size; i++) {
+        void *d1, *d2;
+        int ret1 = get_hash_map(expect, keys[i], keylens[i], &d1);
+        int ret2 = get_hash_map(hash_map, keys[i], keylens[i], &d2);
+        assert(ret1==1 && ret2==1);
+        assert(d1==d2);
+    }
+    //削除と追加もできること
+    int ret;
+    for (int i=0; i<size; i+=2) {
+        ret = del_hash_map(hash_map, keys[i], keylens[i]);
+        assert(ret==1);
+    }
+    for (int i=0; i<size; i++) {
+        ret = get_hash_map(hash_map, keys[i], keylens[i], NULL);
+        assert(ret==i%2);
+    }
+    for (int i=0; i<size; i+=2) {
+        ret = put_hash_map(hash_map, keys[i], keylens[i], NULL);
+        assert(ret==1);
+    }
+    assert(num_hash_map(hash_map)==(size_t)size);
+    free_hash_map(hash_map);
+    free_hash_map(expect);
+
+    hash_map = build_hash_map(&(hash_map_config_t){0}, NULL, NULL, NULL, 0, n_thread);
+    assert(num_hash_map(hash_map)==0);
+    free_hash_map(hash_map);
+    free_keys(keys, keylens, n);
+    free(data);
+}
+
+//マージでデータ（出現回数）を足し、結合した回数を数える（複数のスレッドから呼ばれる）
+static void *merge_add(void *data, void *src_data, void *arg) {
+    __atomic_add_fetch((long*)arg, 1, __ATOMIC_RELAXED);
+    return data + (src_data - (void*)0);
+}
+
+//マージのテスト
+//dstはキー[0,size/4)、srcs[s]はキー[s*size/8, s*size/8+size/2)を持ち、データは出現回数。
+void test_merge(int size, int n_src, int n_thread, int flags) {
+    fprintf(stderr, "=== %s: size=%d, n_src=%d, n_thread=%d, flags=%d\n",  __func__, size, n_src, n_thread, flags);
+    int *keylens;
+    char **keys = make_keys(size, &keylens);
+    hash_map_config_t config = {.flags=flags};
+    hash_map_t *dst = new_hash_map_config(&config);
+    hash_map_t **srcs = malloc(n_src * sizeof(hash_map_t*));
+    assert(srcs);
+    for (int i=0; i<size/4; i++) put_hash_map(dst, keys[i], keylens[i], MAKE_DATA(1));
+    for (int s=0; s<n_src; s++) {
+        srcs[s] = new_hash_map_config(&config);
+        for (int i=s*size/8; i<s*size/8+size/2 && i<size; i++) put_hash_map(srcs[s], keys[i], keylens[i], MAKE_DATA(1));
+        //一部を削除してアリーナに削除済みのキーを残す
+        for (int i=s*size/8; i<s*size/8+size/2 && i<size; i+=7) del_hash_map(srcs[s], keys[i], keylens[i]);
+        for (int i=s*size/8; i<s*size/8+size/2 && i<size; i+=7) put_hash_map(srcs[s], keys[i], keylens[i], MAKE_DATA(1));
+    }
+    long n_combine = 0;
+    merge_hash_map(dst, srcs, n_src, merge_add, &n_combine, n_thread);
+    long expect_combine = 0;
+    size_t num = 0;
+    for (int i=0; i<size; i++) {
+        long cnt = i < size/4;
+        for (int s=0; s<n_src; s++) cnt += i >= s*size/8 && i < s*size/8+size/2;
+        void *d;
+        int ret = get_hash_map(dst, keys[i], keylens[i], &d);
+        assert(ret==(cnt > 0) && (!ret || d==MAKE_DATA(cnt)));
+        num += ret;
+        if (cnt > 1) expect_combine += cnt - 1;
+    }
+    assert(num_hash_map(dst)==num && n_combine==expect_combine);
+
+    //マージ元は空で、再利用できること（キーはdstに移っているので解放してもよい）
+    for (int s=0; s<n_src; s++) {
+        int ret = get_hash_map(srcs[s], keys[0], keylens[0], NULL);
+        assert(num_hash_map(srcs[s])==0 && ret==0);
+        put_hash_map(srcs[s], keys[s], keylens[s], MAKE_DATA(s));
+        ret = get_hash_map(srcs[s], keys[s], keylens[s], NULL);
+        assert(ret==1);
+        free_hash_map(srcs[s]);
+    }
+    size_t cnt = 0;
+    iterator_t it;
+    char *key;
+    int keylen;
+    init_iterate(&it, dst);
+    while (next_iterate(&it, &key, &keylen, NULL)) {
+        int ret = get_hash_map(dst, key, keylen, NULL);
+        assert(ret==1);
+        cnt++;
+    }
+    assert(cnt==num);
+
+    //combineがNULLの場合は後のデータになる
+    hash_map_t *src = new_hash_map_config(&config);
+    for (int i=0; i<size; i++) put_hash_map(src, keys[i], keylens[i], MAKE_DATA(i));
+    merge_hash_map(dst, &src, 1, NULL, NULL, n_thread);
+    assert(num_hash_map(dst)==(size_t)size && num_hash_map(src)==0);
+    for (int i=0; i<size; i++) {
+        void *d;
+        int ret = get_hash_map(dst, keys[i], keylens[i], &d);
+        assert(ret && d==MAKE_DATA(i));
+    }
+    //バケット数がパーティション数より少ないマージ元
+    for (int i=0; i<3; i++) put_hash_map(src, keys[i], keylens[i], MAKE_DATA(i+1));
+    merge_hash_map(dst, &src, 1, NULL, NULL, n_thread);
+    assert(num_hash_map(dst)==(size_t)size && num_hash_map(src)==0);
+    for (int i=0; i<size; i++) {
+        void *d;
+        int ret = get_hash_map(dst, keys[i], keylens[i], &d);
+        assert(ret && d==MAKE_DATA((i < 3 ? i+1 : i)));
+    }
+    free_hash_map(src);
+    free_hash_map(dst);
+    free(srcs);
+    free_keys(keys, keylens, size);
+}
+
+//一括構築とputのループの比較
+void test_build_speed(int size) {
+    int n_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("== Build Speed Test: n=%d, cpus=%d\n", size, n_cpu);
+    int *keylens;
+    char **keys = make_keys(size, &keylens);
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    hash_map_t *hash_map = new_hash_map(0, NULL);
+    for (int i=0; i<size; i++) put_hash_map(hash_map, keys[i], keylens[i], MAKE_DATA(i));
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("put loop:         %.3f sec\n", (t1.tv_sec-t0.tv_sec) + (t1.tv_nsec-t0.tv_nsec)*1e-9);
+    free_hash_map(hash_map);
+    for (int n_thread=1; ; n_thread = n_thread*2<n_cpu ? n_thread*2 : n_cpu) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        hash_map = build_hash_map(&(hash_map_config_t){0}, (const char**)keys, keylens, NULL, size, n_thread);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        assert(num_hash_map(hash_map)==(size_t)size);
+        printf("build threads=%-3d %.3f sec\n", n_thread, (t1.tv_sec-t0.tv_sec) + (t1.tv_nsec-t0.tv_nsec)*1e-9);
+        free_hash_map(hash_map);
+        if (n_thread>=n_cpu) break;
+    }
+    free_keys(keys, keylens, size);
+}
+
+//マージとイテレート・upsertのループの比較
+//n_src個のマップにsize個のキーを分け、キーの種類はsize/2（半分が重複）で、データは出現回数。
+static void merge_speed_srcs(hash_map_t **srcs, int n_src, char **keys, int *keylens, int size) {
+    for (int s=0; s<n_src; s++) {
+        srcs[s] = new_hash_map(0, NULL);
+        for (int j=0; j<size/n_src; j++) {
+            int i = (s*(size/n_src) + j) % (size/2);
+            put_hash_map(srcs[s], keys[i], keylens[i], MAKE_DATA(1));
+        }
+    }
+}
+void test_merge_speed(int size, int n_src) {
+    int n_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("== Merge Speed Test: n=%d, n_src=%d, cpus=%d\n", size, n_src, n_cpu);
+    int *keylens;
+    char **keys = make_keys(size/2, &keylens);
+    hash_map_t **srcs = malloc(n_src * sizeof(hash_map_t*));
+    assert(srcs);
+    struct timespec t0, t1;
+    long n_combine = 0;
+    merge_speed_srcs(srcs, n_src, keys, keylens, size);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    hash_map_t *dst = new_hash_map(0, NULL);
+    for (int s=0; s<n_src; s++) {
+        iterator_t it;
+        char *key;
+        int keylen;
+        void *data;
+        init_iterate(&it, srcs[s]);
+        while (next_iterate(&it, &key, &keylen, &data)) {
+            int inserted;
+            void **slot = upsert_hash_map(dst, key, keylen, &inserted);
+            *slot = inserted ? data : merge_add(*slot, data, &n_combine);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    assert(num_hash_map(dst)==(size_t)size/2);
+    printf("upsert loop:      %.3f sec\n", (t1.tv_sec-t0.tv_sec) + (t1.tv_nsec-t0.tv_nsec)*1e-9);
+    free_hash_map(dst);
+    for (int s=0; s<n_src; s++) free_hash_map(srcs[s]);
+    for (int n_thread=1; ; n_thread = n_thread*2<n_cpu ? n_thread*2 : n_cpu) {
+        merge_speed_srcs(srcs, n_src, keys, keylens, size);
+        dst = new_hash_map(0, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        merge_hash_map(dst, srcs, n_src, merge_add, &n_combine, n_thread);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        assert(num_hash_map(dst)==(size_t)size/2);
+        printf("merge threads=%-3d %.3f sec\n", n_thread, (t1.tv_sec-t0.tv_sec) + (t1.tv_nsec-t0.tv_nsec)*1e-9);
+        free_hash_map(dst);
+        for (int s=0; s<n_src; s++) free_hash_map(srcs[s]);
+        if (n_thread>=n_cpu) break;
+    }
+    free(srcs);
+    free_keys(keys, keylens, size/2);
+}
+
+//スナップショットのテスト
+//データをシリアライズする（"data_n"の文字列にする）
+static const void *save_data_str(void *data, size_t *size, void *arg) {
+    static char buf[32];
+    *size = sprintf(buf, "data_%ld", (long)(data - (void*)0)) + 1;
+    return buf;
+}
+
+void test_snapshot(int size, int serialize) {
+    fprintf(stderr, "=== %s: size=%d, serialize=%d\n",  __func__, size, serialize);
+    char path[] = "/tmp/test_hash_map_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    int *keylens;
+    char **keys = make_keys(size, &keylens);
+    hash_map_config_t config = {.flags=HASH_MAP_INCREMENTAL};
+    hash_map_t *hash_map = new_hash_map_config(&config);
+    for (int i=0; i<size; i++) put_hash_map(hash_map, keys[i], keylens[i], MAKE_DATA(i));
+    int ret = save_hash_map(hash_map, path, serialize ? save_data_str : NULL, NULL);
+    assert(ret==0);
+    free_hash_map(hash_map);
+
+    //ハッシュ関数が違えば読み込めない
+    hash_map = load_hash_map(path, &(hash_map_config_t){.hash_func=crc32_hash});
+    assert(hash_map==NULL);
+    hash_map = load_hash_map(path, &config);
+    assert(hash_map);
+    assert(num_hash_map(hash_map)==(size_t)size);
+    for (int i=0; i<size; i++) {
+        void *d = NULL;
+        ret = get_hash_map(hash_map, keys[i], keylens[i], &d);
+        assert(ret==1);
+        if (serialize) {
+            char buf[32];
+            sprintf(buf, "data_%d", i);
+            assert(strcmp(d, buf)==0);
+        } else {
+            assert(d==MAKE_DATA(i));
+        }
+    }
+    ret = get_hash_map(hash_map, "none", 4, NULL);
+    assert(ret==0);
+
+    iterator_t *iterator = iterate_hash_map(hash_map);
+    char *key;
+    int keylen, num = 0;
+    while (next_iterate(iterator, &key, &keylen, NULL)) {
+        ret = get_hash_map(hash_map, key, keylen, NULL);
+        assert(ret==1);
+        num++;
+    }
+    end_iterate(iterator);
+    assert(num==size);
+    free_hash_map(hash_map);
+    unlink(path);
+    free_keys(keys, keylens, size);
+}
+
+//キーとデータの領域が空のスナップショット（空のハッシュマップ、インラインのキーだけ）
+void test_snapshot_empty_blob(void) {
+    fprintf(stderr, "=== %s\n",  __func__);
+    char path[] = "/tmp/test_hash_map_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    for (int n=0; n<=2; n++) {
+        hash_map_t *hash_map = new_hash_map(0, NULL);
+        if (n >= 1) put_hash_map(hash_map, "a", 1, MAKE_DATA(1));
+        if (n >= 2) put_hash_map(hash_map, "bb", 2, MAKE_DATA(2));
+        int ret = save_hash_map(hash_map, path, NULL, NULL);
+        assert(ret==0);
+        free_hash_map(hash_map);
+
+        hash_map = load_hash_map(path, &(hash_map_config_t){0});
+        assert(hash_map);
+        assert(num_hash_map(hash_map)==(size_t)n);
+        void *d = NULL;
+        ret = get_hash_map(hash_map, "a", 1, &d);
+        assert(ret==(n >= 1) && d==(n >= 1 ? MAKE_DATA(1) : NULL));
+        ret = get_hash_map(hash_map, "bb", 2, &d);
+        assert(ret==(n >= 2) && (n < 2 || d==MAKE_DATA(2)));
+        free_hash_map(hash_map);
+    }
+    unlink(path);
+}
+
+//HASH_MAP_VERIFYを指定すれば、壊れたスナップショットを読み込めないか、読み込めた場合は全てのキーが領域内にあること
+void test_snapshot_corrupt(int size) {
+    fprintf(stderr, "=== %s: size=%d\n",  __func__, size);
+    char path[] = "/tmp/test_hash_map_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    int *keylens;
+    char **keys = make_keys(size, &keylens);
+    hash_map_config_t config = {.flags=HASH_MAP_VERIFY};
+    hash_map_t *hash_map = new_hash_map(0, NULL);
+    for (int i=0; i<size; i++) put_hash_map(hash_map, keys[i], keylens[i], MAKE_DATA(i));
+    int ret = save_hash_map(hash_map, path, save_data_str, NULL);
+    assert(ret==0);
+    free_hash_map(hash_map);
+
+    FILE *fp = fopen(path, "rb");
+    assert(fp);
+    fseek(fp, 0, SEEK_END);
+    long file_size = ftell(fp);
+    char *orig = malloc(file_size), *buf = malloc(file_size);
+    fseek(fp, 0, SEEK_SET);
+    size_t n_read = fread(orig, 1, file_size, fp);
+    assert(n_read==(size_t)file_size);
+    fclose(fp);
+
+    hash_map = load_hash_map(path, &config);
+    assert(hash_map && num_hash_map(hash_map)==(size_t)size);
+    free_hash_map(hash_map);
+
+    //途中で切れたファイルは読み込めない
+    ret = truncate(path, file_size-1);
+    assert(ret==0);
+    hash_map = load_hash_map(path, &config);
+    assert(hash_map==NULL);
+
+    int loaded = 0;
+    for (int n=0; n<1000; n++) {
+        memcpy(buf, orig, file_size);
+        long pos = rand() % file_size;
+        for (int i=0; i<8 && pos+i<file_size; i++) buf[pos+i] = rand();
+        fp = fopen(path, "wb");
+        assert(fp);
+        size_t n_write = fwrite(buf, 1, file_size, fp);
+        assert(n_write==(size_t)file_size);
+        fclose(fp);
+        hash_map = load_hash_map(path, &config);
+        if (!hash_map) continue;
+        loaded++;
+        iterator_t *iterator = iterate_hash_map(hash_map);
+        char *key;
+        int keylen;
+        unsigned sum = 0;
+        while (next_iterate(iterator, &key, &keylen, NULL)) {
+            for (int i=0; i<keylen; i++) sum += key[i];
+        }
+        end_iterate(iterator);
+        for (int i=0; i<size; i++) get_hash_map(hash_map, keys[i], keylens[i], NULL);
+        free_hash_map(hash_map);
+    }
+    fprintf(stderr, "loaded %d/1000\n", loaded);
+    free(orig);
+    free(buf);
+    unlink(path);
+    free_keys(keys, keylens, size);
+}
+
+//スナップショットの読み込みとputによる再構築の比較
+void test_snapshot_speed(int size) {
+    printf("== Snapshot Speed Test: n=%d\n", size);
+    char path[] = "/tmp/test_hash_map_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    int *keylens;
+    char **keys = make_keys(size, &keylens);
+    struct timespec t0, t1, t2, t3, t4;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    hash_map_t *hash_map = new_hash_map(0, NULL);
+    for (int i=0; i<size; i++) put_hash_map(hash_map, keys[i], keylens[i], MAKE_DATA(i));
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    int ret = save_hash_map(hash_map, path, NULL, NULL);
+    assert(ret==0);
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    free_hash_map(hash_map);
+
+    clock_gettime(CLOCK_MONOTONIC, &t3);
+    hash_map = load_hash_map(path, &(hash_map_config_t){0});
+    assert(hash_map);
+    clock_gettime(CLOCK_MONOTONIC, &t4);
+    int n = 0;
+    for (int i=0; i<size; i++) n += get_hash_map(hash_map, keys[i], keylens[i], NULL);
+    struct timespec t5;
+    clock_gettime(CLOCK_MONOTONIC, &t5);
+    assert(n==size);
+    printf("put loop:      %.3f sec\n", (t1.tv_sec-t0.tv_sec) + (t1.tv_nsec-t0.tv_nsec)*1e-9);
+    printf("save:          %.3f sec\n", (t2.tv_sec-t1.tv_sec) + (t2.tv_nsec-t1.tv_nsec)*1e-9);
+    printf("load:          %.6f sec\n", (t4.tv_sec-t3.tv_sec) + (t4.tv_nsec-t3.tv_nsec)*1e-9);
+    printf("get all keys:  %.3f sec (after load)\n", (t5.tv_sec-t4.tv_sec) + (t5.tv_nsec-t4.tv_nsec)*1e-9);
+    free_hash_map(hash_map);
+    unlink(path);
+    free_keys(keys, keylens, size);
+}
+
+//シャーディング版のテスト
+//スレッド毎に別々のキーを追加・検索・削除し、最後に全体を確認する
+#define SHARD_TEST_THREADS 4
+typedef struct {
+    shard_hash_map_t *shard_map;
+    char **keys;
+    int *keylens;
+    int begin, end;
+} shard_test_arg_t;
+
+static void *shard_test_thread(void *p) {
+    shard_test_arg_t *arg = p;
+    int ret;
+    for (int i=arg->begin; i<arg->end; i++) {
+        ret = put_shard_hash_map(arg->shard_map, arg->keys[i], arg->keylens[i], MAKE_DATA(i));
+        assert(ret==1);
+    }
+    for (int i=arg->begin; i<arg->end; i++) {
+        void *d = NULL;
+        ret = get_shard_hash_map(arg->shard_map, arg->keys[i], arg->keylens[i], &d);
+        assert(ret==1);
+        assert(d==MAKE_DATA(i));
+        if (i%2) {
+            ret = del_shard_hash_map(arg->shard_map, arg->keys[i], arg->keylens[i]);
+            assert(ret==1);
+        }
+    }
+    return NULL;
+}
+
+void test_shard(int size, int n_shard, int flags) {
+    fprintf(stderr, "=== %s: size=%d, n_shard=%d, flags=%d\n",  __func__, size, n_shard, flags);
+    int *keylens;
+    char **keys = make_keys(size, &keylens);
+    hash_map_config_t config = {.flags=flags};
+    shard_hash_map_t *shard_map = new_shard_hash_map(n_shard, &config);
+
+    pthread_t th[SHARD_TEST_THREADS];
+    shard_test_arg_t arg[SHARD_TEST_THREADS];
+    for (int t=0; t<SHARD_TEST_THREADS; t++) {
+        arg[t] = (shard_test_arg_t){shard_map, keys, keylens,
+            (long)size*t/SHARD_TEST_THREADS, (long)size*(t+1)/SHARD_TEST_THREADS};
+        int ret = pthread_create(&th[t], NULL, shard_test_thread, &arg[t]);
+        assert(ret==0);
+    }
+    for (int t=0; t<SHARD_TEST_THREADS; t++) pthread_join(th[t], NULL);
+
+    assert(num_shard_hash_map(shard_map)==(size_t)size/2);
+    for (int i=0; i<size; i++) {
+        void *d = NULL;
+        int ret = get_shard_hash_map(shard_map, keys[i], keylens[i], &d);
+        assert(ret==(i%2==0));
+        assert(d==(i%2 ? NULL : MAKE_DATA(i)));
+    }
+    free_shard_hash_map(shard_map);
+    free_keys(keys, keylens, size);
+}
+
+//ロックフリー版のテスト
+//書き込みスレッドが別々のキーを追加・上書き・削除し、読み込みスレッドが並行して検索する
+#define LF_TEST_WRITERS 4
+#define LF_TEST_READERS 2
+typedef struct {
+    lf_hash_map_t *lf_map;
+    char **keys;
+    int *keylens;
+    int size;
+    int begin, end;
+    int inserted;           //put_lf_hash_mapが1を返した数
+    _Atomic int *stop;
+} lf_test_arg_t;
+
+static void *lf_test_writer(void *p) {
+    lf_test_arg_t *arg = p;
+    int ret;
+    for (int i=arg->begin; i<arg->end; i++) {
+        ret = put_lf_hash_map(arg->lf_map, arg->keys[i], arg->keylens[i], MAKE_DATA(i));
+        assert(ret==1);
+    }
+    for (int i=arg->begin; i<arg->end; i++) {
+        ret = put_lf_hash_map(arg->lf_map, arg->keys[i], arg->keylens[i], MAKE_DATA(arg->size+i));
+        assert(ret==0);
+        if (i%2) {
+            ret = del_lf_hash_map(arg->lf_map, arg->keys[i], arg->keylens[i]);
+            assert(ret==1);
+        }
+    }
+    return NULL;
+}
+
+static void *lf_test_inserter(void *p) {
+    lf_test_arg_t *arg = p;
+    for (int i=arg->begin; i<arg->end; i++) {
+        arg->inserted += put_lf_hash_map(arg->lf_map, arg->keys[i], arg->keylens[i], MAKE_DATA(i));
+    }
+    return NULL;
+}
+
+static void *lf_test_reader(void *p) {
+    lf_test_arg_t *arg = p;
+    while (!atomic_load(arg->stop)) {
+        for (int i=0; i<arg->size; i++) {
+            void *d;
+            if (get_lf_hash_map(arg->lf_map, arg->keys[i], arg->keylens[i], &d)) {
+                assert(d==MAKE_DATA(i) || d==MAKE_DATA(arg->size+i));
+            }
+        }
+    }
+    return NULL;
+}
+
+void test_lf(int size) {
+    fprintf(stderr, "=== %s: size=%d\n",  __func__, size);
+    int *keylens;
+    char **keys = make_keys(size, &keylens);
+    _Atomic int stop = 0;
+    lf_hash_map_t *lf_map = new_lf_hash_map(&(hash_map_config_t){0});
+
+    pthread_t th[LF_TEST_WRITERS+LF_TEST_READERS];
+    lf_test_arg_t arg[LF_TEST_WRITERS+LF_TEST_READERS];
+    for (int t=0; t<LF_TEST_WRITERS+LF_TEST_READERS; t++) {
+        arg[t] = (lf_test_arg_t){lf_map, keys, keylens, size,
+            (long)size*t/LF_TEST_WRITERS, (long)size*(t+1)/LF_TEST_WRITERS, 0, &stop};
+        int ret = pthread_create(&th[t], NULL, t<LF_TEST_WRITERS ? lf_test_writer : lf_test_reader, &arg[t]);
+        assert(ret==0);
+    }
+    for (int t=0; t<LF_TEST_WRITERS; t++) pthread_join(th[t], NULL);
+    atomic_store(&stop, 1);
+    for (int t=LF_TEST_WRITERS; t<LF_TEST_WRITERS+LF_TEST_READERS; t++) pthread_join(th[t], NULL);
+
+    assert(num_lf_hash_map(lf_map)==(size_t)size/2);
+    for (int i=0; i<size; i++) {
+        void *d = NULL;
+        int ret = get_lf_hash_map(lf_map, keys[i], keylens[i], &d);
+        assert(ret==(i%2==0));
+        assert(d==(i%2 ? NULL : MAKE_DATA(size+i)));
+    }
+    free_lf_hash_map(lf_map);
+
+    //全スレッドが同じキーを追加しても、新規になるのは1回だけ
+    lf_map = new_lf_hash_map(&(hash_map_config_t){0});
+    for (int t=0; t<LF_TEST_WRITERS; t++) {
+        arg[t] = (lf_test_arg_t){lf_map, keys, keylens, size, 0, size, 0, &stop};
+        int ret = pthread_create(&th[t], NULL, lf_test_inserter, &arg[t]);
+        assert(ret==0);
+    }
+    int inserted = 0;
+    for (int t=0; t<LF_TEST_WRITERS; t++) {
+        pthread_join(th[t], NULL);
+        inserted += arg[t].inserted;
+    }
+    assert(inserted==size);
+    assert(num_lf_hash_map(lf_map)==(size_t)size);
+    free_lf_hash_map(lf_map);
+    free_keys(keys, keylens, size);
+}
+
+//シャーディング版とロックフリー版のスループット
+//読み込みの割合を変えて、スレッド数を1からコア数まで増やす
+#define SHARD_SPEED_OPS (200*10000)     //1スレッドあたりの操作数
+typedef struct {
+    shard_hash_map_t *shard_map;
+    lf_hash_map_t *lf_map;          //NULLでなければロックフリー版を使う
+    char **keys;
+    int *keylens;
+    int size;
+    int read_pct;
+    uint64_t seed;
+} shard_speed_arg_t;
+
+static void *shard_speed_thread(void *p) {
+    shard_speed_arg_t *arg = p;
+    uint64_t x = arg->seed;
+    for (int i=0; i<SHARD_SPEED_OPS; i++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        int k = (x >> 8) % arg->size;
+        if (arg->lf_map) {
+            if ((int)(x % 100) < arg->read_pct) {
+                get_lf_hash_map(arg->lf_map, arg->keys[k], arg->keylens[k], NULL);
+            } else if (x & 0x80) {
+                put_lf_hash_map(arg->lf_map, arg->keys[k], arg->keylens[k], MAKE_DATA(k));
+            } else {
+                del_lf_hash_map(arg->lf_map, arg->keys[k], arg->keylens[k]);
+            }
+        } else if ((int)(x % 100) < arg->read_pct) {
+            get_shard_hash_map(arg->shard_map, arg->keys[k], arg->keylens[k], NULL);
+        } else if (x & 0x80) {
+            put_shard_hash_map(arg->shard_map, arg->keys[k], arg->keylens[k], MAKE_DATA(k));
+        } else {
+            del_shard_hash_map(arg->shard_map, arg->keys[k], arg->keylens[k]);
+        }
+    }
+    return NULL;
+}
+
+void test_shard_speed(int size) {
+    static const struct { int read_pct; const char *name; } mix[] = {
+        {95, "read-heavy"}, {50, "mixed"}, {5, "write-heavy"},
+    };
+    int n_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_cpu < 1) n_cpu = 1;
+    printf("== Shard/Lock-free Speed Test: n=%d, ops/thread=%d, cpus=%d\n", size, SHARD_SPEED_OPS, n_cpu);
+    int *keylens;
+    char **keys = make_keys(size, &keylens);
+    pthread_t *th = malloc(n_cpu * sizeof(pthread_t));
+    shard_speed_arg_t *arg = malloc(n_cpu * sizeof(shard_speed_arg_t));
+    assert(th && arg);
+
+    for (int m=0; m<3; m++) {
+        //シャード数1はグローバルロックと同じ、0はロックフリー版
+        static const int shards[] = {1, 64, 0};
+        for (int s=0; s<3; s++) {
+            int n_shard = shards[s];
+            for (int n_th=1; ; n_th = n_th*2<n_cpu ? n_th*2 : n_cpu) {
+                hash_map_config_t config = {.init_size=size};
+                shard_hash_map_t *shard_map = n_shard ? new_shard_hash_map(n_shard, &config) : NULL;
+                lf_hash_map_t *lf_map = n_shard ? NULL : new_lf_hash_map(&config);
+                for (int i=0; i<size; i+=2) {
+                    if (lf_map) put_lf_hash_map(lf_map, keys[i], keylens[i], MAKE_DATA(i));
+                    else put_shard_hash_map(shard_map, keys[i], keylens[i], MAKE_DATA(i));
+                }
+                struct timespec t0, t1;
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+                for (int t=0; t<n_th; t++) {
+                    arg[t] = (shard_speed_arg_t){shard_map, lf_map, keys, keylens, size, mix[m].read_pct, 0x9E3779B97F4A7C15ULL*(t+1)};
+                    int ret = pthread_create(&th[t], NULL, shard_speed_thread, &arg[t]);
+                    assert(ret==0);
+                }
+                for (int t=0; t<n_th; t++) pthread_join(th[t], NULL);
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                double sec = (t1.tv_sec-t0.tv_sec) + (t1.tv_nsec-t0.tv_nsec)*1e-9;
+                printf("%-11s %-9s threads=%-3d %.2f Mops/s\n", mix[m].name,
+                    n_shard==1 ? "1 shard" : n_shard ? "64 shards" : "lock-free", n_th, (double)n_th*SHARD_SPEED_OPS/sec/1e6);
+                free_shard_hash_map(shard_map);
+                free_lf_hash_map(lf_map);
+                if (n_th==n_cpu) break;
+            }
+        }
+    }
+    free(th);
+    free(arg);
+    free_keys(keys, keylens, size);
+}
+
+//整数キーのハッシュマップ
+HASH_MAP_INIT_INT64(u64, void*)
+HASH_MAP_INIT_INT32(u32, int)
+
+//整数キーのハッシュマップがhash_map_tと同じ結果になること
+//0、最大値、連番、ランダムな値をキーにする。
+void test_int(int size) {
+    fprintf(stderr, "=== %s: size=%d\n",  __func__, size);
+    uint64_t *keys = malloc(2*size * sizeof(uint64_t));
+    assert(keys);
+    uint64_t x = 1;
+    for (int i=0; i<2*size; i++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        keys[i] = i==0 ? 0 : i==1 ? UINT64_MAX : i%2 ? (uint64_t)i : x;
+    }
+    u64_hash_map_t *map = new_u64_hash_map(0);
+    hash_map_t *ref = new_hash_map(0, NULL);
+    for (int i=0; i<size; i++) {
+        int ret = put_hash_map(ref, (char*)&keys[i], 8, MAKE_DATA(i));
+        int ret2 = put_u64_hash_map(map, keys[i], MAKE_DATA(i));
+        assert(ret2==ret);
+    }
+    //半分を上書きし、1/3を削除する
+    for (int i=0; i<size; i+=2) {
+        put_hash_map(ref, (char*)&keys[i], 8, MAKE_DATA(size+i));
+        int ret = put_u64_hash_map(map, keys[i], MAKE_DATA(size+i));
+        assert(ret==0);
+    }
+    for (int i=0; i<size; i+=3) {
+        int ret = del_hash_map(ref, (char*)&keys[i], 8);
+        int ret2 = del_u64_hash_map(map, keys[i]);
+        assert(ret2==ret);
+    }
+    assert(num_u64_hash_map(map)==(size_t)num_hash_map(ref));
+    for (int i=0; i<2*size; i++) {
+        void *d1 = NULL, *d2 = NULL;
+        int ret = get_hash_map(ref, (char*)&keys[i], 8, &d2);
+        int ret2 = get_u64_hash_map(map, keys[i], &d1);
+        assert(ret2==ret);
+        assert(d1==d2);
+    }
+    //イテレートで全データを1回ずつ返す
+    size_t pos = 0, n = 0;
+    uint64_t key;
+    void *data;
+    while (next_u64_hash_map(map, &pos, &key, &data)) {
+        void *d = NULL;
+        int ret = get_hash_map(ref, (char*)&key, 8, &d);
+        assert(ret && d==data);
+        n++;
+    }
+    assert(n==num_u64_hash_map(map));
+    for (int i=0; i<size; i++) del_u64_hash_map(map, keys[i]);
+    assert(num_u64_hash_map(map)==0);
+    free_u64_hash_map(map);
+    free_hash_map(ref);
+
+    //32ビットのキー（i*2654435761は2^32未満で重複しない）、reserve
+    u32_hash_map_t *map32 = new_u32_hash_map(0);
+    reserve_u32_hash_map(map32, size);
+    size_t capacity = map32->capacity;
+    for (int i=0; i<size; i++) {
+        int ret = put_u32_hash_map(map32, i * 2654435761u, i);
+        assert(ret==1);
+    }
+    assert(map32->capacity==capacity);
+    for (int i=0; i<size; i++) {
+        int v;
+        int ret = get_u32_hash_map(map32, i * 2654435761u, &v);
+        assert(ret && v==i);
+    }
+    free_u32_hash_map(map32);
+    free(keys);
+}
+
+//整数キーのハッシュマップとhash_map_t（8バイトのキー）の速度とメモリ
+void test_int_speed(int size) {
+    printf("== Int Key Speed Test: n=%d\n", size);
+    uint64_t *keys = malloc(size * sizeof(uint64_t));
+    assert(keys);
+    for (int i=0; i<size; i++) keys[i] = (uint64_t)i * 0x9E3779B97F4A7C15ULL;
+    struct timespec t0, t1, t2;
+    for (int type=0; type<2; type++) {
+        size_t mem0 = mallinfo2().uordblks + mallinfo2().hblkhd;
+        hash_map_t *hash_map = NULL;
+        u64_hash_map_t *map = NULL;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (type==0) {
+            hash_map = new_hash_map(0, NULL);
+            for (int i=0; i<size; i++) put_hash_map(hash_map, (char*)&keys[i], 8, MAKE_DATA(i));
+        } else {
+            map = new_u64_hash_map(0);
+            for (int i=0; i<size; i++) put_u64_hash_map(map, keys[i], MAKE_DATA(i));
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        size_t mem = mallinfo2().uordblks + mallinfo2().hblkhd - mem0;
+        long found = 0;
+        for (int i=0; i<size; i++) {
+            uint64_t k = keys[(uint64_t)i * 7919 % size];
+            if (type==0) found += get_hash_map(hash_map, (char*)&k, 8, NULL);
+            else found += get_u64_hash_map(map, k, NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+        assert(found==size);
+        double put_sec = (t1.tv_sec-t0.tv_sec) + (t1.tv_nsec-t0.tv_nsec)*1e-9;
+        double get_sec = (t2.tv_sec-t1.tv_sec) + (t2.tv_nsec-t1.tv_nsec)*1e-9;
+        printf("%-10s put %.1f ns/op, get %.1f ns/op, %.1f bytes/entry\n", type ? "u64" : "hash_map",
+            put_sec*1e9/size, get_sec*1e9/size, (double)mem/size);
+        if (type==0) free_hash_map(hash_map);
+        else free_u64_hash_map(map);
+    }
+    free(keys);
+}
+
 //Speed Test
 //size: データ数
-void test_speed(long size, hash_func_t hash_func, const char *func_name) {
+void test_speed(long size, hash_map_config_t config, const char *func_name) {
     printf("== Speed Test: n=%ld\n", size);
 
     struct rusage ru0;
     getrusage(RUSAGE_SELF, &ru0);
 
-    test_hash_map(size, hash_func, func_name);
+    test_hash_map(size, config, func_name);
 
     //結果表示
     print_usage(&ru0);
 }
 
+//ハッシュ関数のスループット
+#define HASH_SPEED_BYTES (256*1024*1024)    //1回の計測でハッシュするバイト数
+static uint64_t fnv1a_hash64(const char *s, int len) { return fnv1a_hash(s, len); }
+static uint64_t fnv1_hash64 (const char *s, int len) { return fnv1_hash(s, len); }
+static uint64_t crc32_hash64(const char *s, int len) { return crc32_hash(s, len); }
+static uint64_t crc32c_hash64(const char *s, int len) { return crc32c_hash(s, len); }
+void test_hash_func_speed(void) {
+    static const struct {
+        const char *name;
+        hash64_func_t func;
+    } funcs[] = {
+        {"FNV-1A", fnv1a_hash64},
+        {"FNV-1",  fnv1_hash64},
+        {"CRC32",  crc32_hash64},
+        {"CRC32C", crc32c_hash64},
+        {"wyhash", wy_hash},
+    };
+    static const int lens[] = {4, 8, 16, 32, 64, 256, 1024, 4096};
+    char *buf = malloc(4096+64);
+    assert(buf);
+    for (int i=0; i<4096+64; i++) buf[i] = rand();
+
+    printf("== Hash Speed Test: GB/s\n%-8s", "keylen");
+    for (int j=0; j<(int)(sizeof(lens)/sizeof(int)); j++) printf("%8d", lens[j]);
+    printf("\n");
+    for (int f=0; f<(int)(sizeof(funcs)/sizeof(funcs[0])); f++) {
+        printf("%-8s", funcs[f].name);
+        for (int j=0; j<(int)(sizeof(lens)/sizeof(int)); j++) {
+            int len = lens[j];
+            long n = HASH_SPEED_BYTES / len;
+            uint64_t sum = 0;
+            struct timespec t0, t1;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            for (long i=0; i<n; i++) {
+                sum += funcs[f].func(buf + (i&63), len);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            double sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+            printf("%8.2f", (double)n*len/sec/1e9 + (sum==1?1e-9:0));
+        }
+        printf("\n");
+    }
+    free(buf);
+}
+
+static int cmp_long(const void *a, const void *b) {
+    long x = *(const long*)a, y = *(const long*)b;
+    return x<y ? -1 : x>y;
+}
+
+//put_hash_mapとdel_hash_mapのレイテンシ分布
+//size: データ数
+//delは長いキーの追加と削除を繰り返して計測する（削除でキーアリーナのコンパクションが起きる）。
+void test_latency(long size, int flags) {
+    printf("== Latency Test: n=%ld, flags=%d\n", size, flags);
+    char key[128];
+    long *ns = malloc(size * sizeof(long));
+    assert(ns);
+    hash_map_config_t config = {.flags=flags};
+    hash_map_t *hash_map = new_hash_map_config(&config);
+    for (long i=0; i<size; i++) {
+        MAKE_KEY(key, (int)i);
+        int keylen = strlen(key);
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        put_hash_map(hash_map, key, keylen, MAKE_DATA(i));
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        ns[i] = (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec);
+    }
+    free_hash_map(hash_map);
+    qsort(ns, size, sizeof(long), cmp_long);
+    printf("put: p50=%ldns p99=%ldns p99.9=%ldns max=%ldns\n",
+        ns[size/2], ns[size*99/100], ns[size*999/1000], ns[size-1]);
+
+    //size/4個の長いキーを保持したまま、古いキーを削除して新しいキーを追加する
+    hash_map = new_hash_map_config(&config);
+    long window = size/4, n_del = 0;
+    for (long i=0; i<size; i++) {
+        sprintf(key, "%08ld_latency_%08lx", i, i);
+        put_hash_map(hash_map, key, strlen(key), MAKE_DATA(i));
+        if (i < window) continue;
+        sprintf(key, "%08ld_latency_%08lx", i-window, i-window);
+        int keylen = strlen(key);
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        int ret = del_hash_map(hash_map, key, keylen);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        assert(ret==1);
+        ns[n_del++] = (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec);
+    }
+    hash_map_stats_t stats;
+    stats_hash_map(hash_map, &stats);
+    assert(stats.num==(size_t)window && stats.key_bytes==(size_t)window*25);
+    free_hash_map(hash_map);
+    qsort(ns, n_del, sizeof(long), cmp_long);
+    printf("del: p50=%ldns p99=%ldns p99.9=%ldns max=%ldns\n",
+        ns[n_del/2], ns[n_del*99/100], ns[n_del*999/1000], ns[n_del-1]);
+    free(ns);
+}
+
+//ハッシュ関数の既知の値
+void test_hash_func(void) {
+    const char *s = "123456789";
+    assert(crc32_hash(s, 9)==0xCBF43926);
+    assert(crc32c_hash(s, 9)==0xE3069283);
+    assert(fnv1a_hash("", 0)==2166136261u);
+    //slicing-by-8の端数処理
+    char buf[64];
+    for (int i=0; i<64; i++) buf[i] = i*7;
+    for (int len=0; len<64; len++) {
+        uint32_t c = 0xFFFFFFFF;
+        for (int i=0; i<len; i++) {
+            c ^= (uint8_t)buf[i];
+            for (int j=0; j<8; j++) c = (c & 1) ? (0x82F63B78 ^ (c >> 1)) : (c >> 1);
+        }
+        assert(crc32c_hash(buf, len)==(c ^ 0xFFFFFFFF));
+    }
+}
+
 void test_func(void) {
     int size = 10000;
-    test_hash_map(size, NULL, "FNV-1A(Default)");
+    test_hash_func();
+    test_keylen();
+    test_churn(size);
+    test_copy(size*20);
+    test_batch(size, 0);
+    test_batch(size, HASH_MAP_INCREMENTAL);
+    test_shard(size, 1, 0);
+    test_shard(size, 16, 0);
+    test_shard(size, 16, HASH_MAP_INCREMENTAL);
+    test_lf(size);
+    test_reserve(size, 0);
+    test_reserve(size, HASH_MAP_INCREMENTAL);
+    test_upsert(size, 0);
+    test_upsert(size, HASH_MAP_INCREMENTAL);
+    test_cache(size);
+    test_allocator(size, 0);
+    test_allocator(size, HASH_MAP_INCREMENTAL);
+    test_allocator(size, HASH_MAP_HUGE_PAGES);
+    test_stats(size, 0);
+    test_stats(size, HASH_MAP_INCREMENTAL);
+    test_int(size);
+    test_large_index(20, size);
+    test_build(size, 1);
+    test_build(size*2, 4);
+    test_build(100, 4);
+    test_merge(size, 4, 1, 0);
+    test_merge(size*4, 8, 4, HASH_MAP_INCREMENTAL);
+    test_merge(100, 3, 4, 0);
+    test_snapshot(size, 0);
+    test_snapshot(size, 1);
+    test_snapshot_empty_blob();
+    test_snapshot_corrupt(1000);
+
+    test_hash_map(size, (hash_map_config_t){0}, "FNV-1A(Default)");
+
+    test_hash_map(size, (hash_map_config_t){.hash_func=fnv1_hash}, "FNV1-1");
 
-    test_hash_map(size, fnv1_hash, "FNV1-1");
+    test_hash_map(size, (hash_map_config_t){.hash_func=crc32_hash}, "CRC32");
 
-    test_hash_map(size, crc32_hash, "CRC32");
+    test_hash_map(size, (hash_map_config_t){.hash64_func=wy_hash}, "wyhash");
+
+    test_hash_map(size, (hash_map_config_t){.hash_func=crc32c_hash}, "CRC32C");
+
+    test_hash_map(size, (hash_map_config_t){.flags=HASH_MAP_INCREMENTAL}, "FNV-1A(Default)");
 
     printf("== Functional Test: OK\n");
 }
@@ -185,8 +1907,41 @@ int main(int argc, char **argv) {
 
     test_func();
 
-    test_speed(100*10000, fnv1a_hash, "FNV-1A");
-    test_speed(100*10000, crc32_hash, "CRC32");
+    test_speed(100*10000, (hash_map_config_t){.hash_func=fnv1a_hash}, "FNV-1A");
+    test_speed(100*10000, (hash_map_config_t){.hash_func=crc32_hash}, "CRC32");
+    test_speed(100*10000, (hash_map_config_t){.hash64_func=wy_hash}, "wyhash");
+
+    //大きなサイズで計測するテストは引数にspeedを指定した場合だけ（数分かかり、メモリも2GB近く必要）
+    int speed = argc > 1 && strcmp(argv[1], "speed")==0;
+
+    if (speed) test_hash_func_speed();
+
+    if (speed) test_batch_speed(1000*10000);
+
+    if (speed) test_latency(400*10000, 0);
+    if (speed) test_latency(400*10000, HASH_MAP_INCREMENTAL);
+
+    if (speed) test_int_speed(1000*10000);
+
+    if (speed) test_upsert_speed(1000*10000, 100*10000);
+
+    if (speed) test_scan_speed(1000*10000);
+
+    if (speed) test_cache_speed(400*10000);
+
+    if (speed) test_huge_page_speed(1000*10000);
+
+    if (speed) test_shard_speed(100*10000);
+
+    if (speed) test_snapshot_speed(400*10000);
+
+    if (speed) test_build_speed(1000*10000);
+
+    if (speed) test_merge_speed(1000*10000, 8);
+    //1億件はメモリが10GB以上必要なので引数で指定した場合だけ
+    if (argc > 1 && strcmp(argv[1], "large")==0) test_build_speed(10000*10000);
+    //2^33バケットは制御バイトだけで8GB必要なので引数で指定した場合だけ
+    if (argc > 1 && strcmp(argv[1], "large")==0) test_large_index(33, 100*10000);
 
     return 0;
 }